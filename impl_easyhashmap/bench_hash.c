@@ -0,0 +1,86 @@
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hash.h"
+
+// hashes of every key length in `lens` over the same random bytes, each
+// call starts at a different offset so nothing can be hoisted out of the
+// loop, fnv1a is the byte at a time baseline
+//
+//   ./bench_hash [BYTES]
+#define BUF_LEN (64 * 1024)
+
+static volatile uint64_t sink;
+
+static uint64_t fnv1a(const void *key, size_t len, uint64_t seed) {
+  const uint8_t *p = key;
+  uint64_t h = 0xcbf29ce484222325ull ^ seed;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ p[i]) * 0x100000001b3ull;
+  return h;
+}
+
+static uint64_t wy(const void *key, size_t len, uint64_t seed) {
+  return hash_wy(key, len, seed);
+}
+
+static uint64_t xx(const void *key, size_t len, uint64_t seed) {
+  return hash_xx(key, len, seed);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// inlined at every call site so the hash is a direct call, or inlined too
+static inline __attribute__((always_inline)) double
+time_hash(uint64_t (*hash)(const void *, size_t, uint64_t), const uint8_t *buf,
+          size_t len, size_t n) {
+  uint64_t acc = 0;
+  const double start = now();
+  for (size_t i = 0; i < n; i++)
+    acc += hash(buf + (i * 61 & (BUF_LEN - 1)), len, i);
+  const double elapsed = now() - start;
+  sink += acc;
+  return elapsed * 1e9 / n;
+}
+
+int main(int argc, char *argv[]) {
+  const size_t total = argc > 1 ? strtoul(argv[1], NULL, 10) : 1 << 28;
+  const char *names[] = {"wyhash", "xxh64", "fnv1a"};
+  const size_t lens[] = {1, 3, 4, 7, 8, 12, 16, 24, 32, 48, 64, 100, 256, 1024};
+
+  uint8_t *buf = malloc(BUF_LEN + 4096);
+  uint64_t x = hash_seed();
+  for (size_t i = 0; i < BUF_LEN + 4096; i++) {
+    x = x * 6364136223846793005ull + 1442695040888963407ull;
+    buf[i] = x >> 56;
+  }
+
+  printf("%6s", "len");
+  for (size_t h = 0; h < 3; h++)
+    printf(" %10s %8s", names[h], "");
+  printf("\n%6s", "");
+  for (size_t h = 0; h < 3; h++)
+    printf(" %10s %8s", "ns/hash", "GB/s");
+  printf("\n");
+
+  for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+    const size_t len = lens[l];
+    const size_t n = total / len < 1000 ? 1000 : total / len;
+    const double ns[] = {time_hash(wy, buf, len, n), time_hash(xx, buf, len, n),
+                         time_hash(fnv1a, buf, len, n)};
+    printf("%6zu", len);
+    for (size_t h = 0; h < 3; h++)
+      printf(" %10.2f %8.2f", ns[h], len / ns[h]);
+    printf("\n");
+  }
+
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,168 @@
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// seeded string hashes that read eight bytes at a time, a table picks a
+// fresh seed from hash_seed so colliding keys can not be precomputed
+//
+//   hash_wy  after wyhash, one 64x64->128 bit multiply per 16 bytes
+//   hash_xx  xxh64, four independent lanes for long keys, no wide multiply
+__extension__ typedef unsigned __int128 hash_u128;
+
+static const uint64_t HASH_WY_SECRET[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull,
+    0x589965cc75374cc3ull};
+
+#define HASH_XX_P1 11400714785074694791ull
+#define HASH_XX_P2 14029467366897019727ull
+#define HASH_XX_P3 1609587929392839161ull
+#define HASH_XX_P4 9650029242287828579ull
+#define HASH_XX_P5 2870177450012600261ull
+
+// unaligned little endian loads, memcpy compiles to a single mov
+static inline uint64_t hash_read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t hash_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t hash_rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// fold the full 128 bit product back into 64 bits
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+  const hash_u128 r = (hash_u128)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t hash_wy(const void *key, size_t len, uint64_t seed) {
+  const uint8_t *p = key;
+  const uint64_t *s = HASH_WY_SECRET;
+  uint64_t a, b;
+  seed ^= hash_mix(seed ^ s[0], s[1]);
+  if (len <= 16) {
+    // short keys are covered by up to four overlapping loads, no loop
+    if (len >= 4) {
+      const size_t mid = (len >> 3) << 2;
+      a = (hash_read32(p) << 32) | hash_read32(p + mid);
+      b = (hash_read32(p + len - 4) << 32) | hash_read32(p + len - 4 - mid);
+    } else if (len > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = hash_mix(hash_read64(p) ^ s[1], hash_read64(p + 8) ^ seed);
+        see1 = hash_mix(hash_read64(p + 16) ^ s[2], hash_read64(p + 24) ^ see1);
+        see2 = hash_mix(hash_read64(p + 32) ^ s[3], hash_read64(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = hash_mix(hash_read64(p) ^ s[1], hash_read64(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = hash_read64(p + i - 16);
+    b = hash_read64(p + i - 8);
+  }
+  return hash_mix(s[1] ^ len, hash_mix(a ^ s[1], b ^ seed));
+}
+
+static inline uint64_t hash_xx_round(uint64_t acc, uint64_t input) {
+  acc += input * HASH_XX_P2;
+  return hash_rotl(acc, 31) * HASH_XX_P1;
+}
+
+static inline uint64_t hash_xx_merge(uint64_t acc, uint64_t v) {
+  acc ^= hash_xx_round(0, v);
+  return acc * HASH_XX_P1 + HASH_XX_P4;
+}
+
+static inline uint64_t hash_xx(const void *key, size_t len, uint64_t seed) {
+  const uint8_t *p = key;
+  const uint8_t *end = p + len;
+  uint64_t h;
+  if (len >= 32) {
+    uint64_t v1 = seed + HASH_XX_P1 + HASH_XX_P2;
+    uint64_t v2 = seed + HASH_XX_P2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - HASH_XX_P1;
+    do {
+      v1 = hash_xx_round(v1, hash_read64(p));
+      v2 = hash_xx_round(v2, hash_read64(p + 8));
+      v3 = hash_xx_round(v3, hash_read64(p + 16));
+      v4 = hash_xx_round(v4, hash_read64(p + 24));
+      p += 32;
+    } while (p + 32 <= end);
+    h = hash_rotl(v1, 1) + hash_rotl(v2, 7) + hash_rotl(v3, 12) +
+        hash_rotl(v4, 18);
+    h = hash_xx_merge(h, v1);
+    h = hash_xx_merge(h, v2);
+    h = hash_xx_merge(h, v3);
+    h = hash_xx_merge(h, v4);
+  } else {
+    h = seed + HASH_XX_P5;
+  }
+
+  h += len;
+  for (; p + 8 <= end; p += 8)
+    h = hash_rotl(h ^ hash_xx_round(0, hash_read64(p)), 27) * HASH_XX_P1 +
+        HASH_XX_P4;
+  if (p + 4 <= end) {
+    h = hash_rotl(h ^ hash_read32(p) * HASH_XX_P1, 23) * HASH_XX_P2 +
+        HASH_XX_P3;
+    p += 4;
+  }
+  for (; p < end; p++)
+    h = hash_rotl(h ^ *p * HASH_XX_P5, 11) * HASH_XX_P1;
+
+  h ^= h >> 33;
+  h *= HASH_XX_P2;
+  h ^= h >> 29;
+  h *= HASH_XX_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+// integer and pointer keys, one hash_mix spreads them over the low bits
+// that pick a slot and the high bits alike
+static inline uint64_t hash_u64(uint64_t x, uint64_t seed) {
+  return hash_mix(x ^ seed ^ HASH_WY_SECRET[0], HASH_WY_SECRET[1]);
+}
+
+// entropy from the OS once per process, every call after that is a step
+// of a counter through hash_mix so two tables never share a seed
+static inline uint64_t hash_seed(void) {
+  static uint64_t base = 0;
+  static uint64_t count = 0;
+  if (base == 0 && getentropy(&base, sizeof(base)) != 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    base = hash_mix(ts.tv_sec ^ HASH_WY_SECRET[0],
+                    ts.tv_nsec ^ (uintptr_t)&base ^ HASH_WY_SECRET[1]);
+  }
+  count += 1;
+  return hash_mix(base ^ HASH_WY_SECRET[2], count ^ HASH_WY_SECRET[3]);
+}
+
+#endif // HASH_H_
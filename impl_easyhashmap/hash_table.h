@@ -0,0 +1,356 @@
+#ifndef HASH_TABLE_H_
+#define HASH_TABLE_H_
+
+// madvise and sysconf are not part of ISO C, a -std=c11 build only sees
+// them with this, so the header goes in before any other system header
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hash.h"
+
+// typed open addressing tables, hash_table_template(T, pre, K, V, hash, eq)
+// declares the table T over slots T##Slot and its functions pre##init,
+// pre##free, pre##get, pre##set and pre##del, `hash` and `eq` are called by
+// name so they inline into the probe loops like everything else
+//
+//   uint64_t hash(K k, uint64_t seed)
+//   bool eq(K a, K b)
+//
+// a table grows once its keys and tombstones pass HASH_LOAD_MAX / 8 of the
+// capacity and shrinks once its keys drop below HASH_LOAD_MIN / 16, the
+// slots of the old array then move over HASH_REHASH_STEP at a time on every
+// set and del, so no single call pays for the whole table
+#define HASH_LOAD_MAX 7
+#define HASH_LOAD_MIN 1
+#define HASH_REHASH_STEP 32
+// the drained front of the old slots goes back to the OS HASH_RELEASE_BYTES
+// at a time while it is moved over, so freeing the rest at the end is cheap
+#define HASH_RELEASE_BYTES (64 * 1024)
+// built with HASH_SWISS a table probes whole groups of HASH_GROUP slots
+// through their control bytes instead of robin hood over the slots
+#ifdef HASH_SWISS
+#define HASH_GROUP 16
+#define HASH_EXP_MIN 4
+#else
+#define HASH_EXP_MIN 3
+#endif
+
+// the whole pages inside [p, p + len) read back as zeros from now on, in
+// both modes that is an empty slot, returns how far from `p` they reach so
+// the next call starts in the page this one stopped short of
+static inline size_t hash_release(void *p, size_t len) {
+  static uintptr_t page = 0;
+  if (page == 0)
+    page = sysconf(_SC_PAGESIZE);
+  const uintptr_t lo = ((uintptr_t)p + page - 1) & ~(page - 1);
+  const uintptr_t hi = ((uintptr_t)p + len) & ~(page - 1);
+  if (lo >= hi || madvise((void *)lo, hi - lo, MADV_DONTNEED) != 0)
+    return 0;
+  return hi - (uintptr_t)p;
+}
+
+#ifdef HASH_SWISS
+
+// every slot has a control byte, the `cap` of them follow the slots in the
+// same block, a full slot's byte holds the top 7 bits of its hash, a group
+// is probed with one compare of all its bytes against the tag and the keys
+// of the matches alone are looked at, a lookup stops at the first group
+// with an empty slot
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+
+static inline uint8_t htag(uint64_t h) { return h >> 57; }
+
+#ifdef __SSE2__
+static inline uint32_t hgroup_match(const uint8_t *g, uint8_t tag) {
+  const __m128i ctrl = _mm_loadu_si128((const __m128i *)g);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag)));
+}
+
+// empty and deleted are the bytes with the top bit set
+static inline uint32_t hgroup_free(const uint8_t *g) {
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)g));
+}
+#else
+static inline uint32_t hgroup_match(const uint8_t *g, uint8_t tag) {
+  uint32_t m = 0;
+  for (int i = 0; i < HASH_GROUP; ++i)
+    m |= (uint32_t)(g[i] == tag) << i;
+  return m;
+}
+
+static inline uint32_t hgroup_free(const uint8_t *g) {
+  uint32_t m = 0;
+  for (int i = 0; i < HASH_GROUP; ++i)
+    m |= (uint32_t)(g[i] >> 7) << i;
+  return m;
+}
+#endif
+
+// groups are visited at triangular offsets, which reach every group of a
+// power of two table
+static inline int hgroup_next(int g, int step, int cap) {
+  return (g + step * HASH_GROUP) & (cap - 1);
+}
+
+#define hash_table_probe(T, pre, K, V, hash, eq)                               \
+  static inline uint8_t *pre##ctrl(const T##Slot *slots, int cap) {            \
+    return (uint8_t *)(slots + cap);                                           \
+  }                                                                            \
+                                                                               \
+  static inline T##Slot *pre##alloc(int cap) {                                 \
+    T##Slot *slots = calloc(1, cap * (sizeof(T##Slot) + 1));                   \
+    if (slots)                                                                 \
+      memset(pre##ctrl(slots, cap), CTRL_EMPTY, cap);                          \
+    return slots;                                                              \
+  }                                                                            \
+                                                                               \
+  static inline int pre##find(const T##Slot *slots, int cap, uint64_t h,       \
+                              K k) {                                           \
+    const uint8_t *ctrl = pre##ctrl(slots, cap);                               \
+    const uint8_t tag = htag(h);                                               \
+    int g = h & (cap - 1) & ~(HASH_GROUP - 1);                                 \
+    for (int step = 1; step <= cap / HASH_GROUP; ++step) {                     \
+      for (uint32_t m = hgroup_match(ctrl + g, tag); m; m &= m - 1) {          \
+        const int i = g + __builtin_ctz(m);                                    \
+        if (eq(slots[i].k, k))                                                 \
+          return i;                                                            \
+      }                                                                        \
+      if (hgroup_match(ctrl + g, CTRL_EMPTY))                                  \
+        return -1;                                                             \
+      g = hgroup_next(g, step, cap);                                           \
+    }                                                                          \
+    return -1;                                                                 \
+  }                                                                            \
+                                                                               \
+  static inline void pre##insert(T *ht, uint64_t h, K k, V v) {                \
+    uint8_t *ctrl = pre##ctrl(ht->kvs, ht->cap);                               \
+    int g = h & (ht->cap - 1) & ~(HASH_GROUP - 1);                             \
+    uint32_t m;                                                                \
+    for (int step = 1; !(m = hgroup_free(ctrl + g)); ++step)                   \
+      g = hgroup_next(g, step, ht->cap);                                       \
+    const int i = g + __builtin_ctz(m);                                        \
+    if (ctrl[i] == CTRL_DELETED)                                               \
+      ht->dead -= 1;                                                           \
+    ctrl[i] = htag(h);                                                         \
+    ht->kvs[i] = (T##Slot){k, v, 1};                                           \
+  }                                                                            \
+                                                                               \
+  /* a group that still has an empty slot never stopped a probe from */        \
+  /* ending there, so its slots can go back to empty, a full group leaves */   \
+  /* a tombstone, returns whether it did */                                    \
+  static inline bool pre##remove(T##Slot *slots, int cap, int i) {             \
+    uint8_t *ctrl = pre##ctrl(slots, cap);                                     \
+    const int g = i & ~(HASH_GROUP - 1);                                       \
+    const bool dead = !hgroup_match(ctrl + g, CTRL_EMPTY);                     \
+    ctrl[i] = dead ? CTRL_DELETED : CTRL_EMPTY;                                \
+    memset(&slots[i], 0, sizeof(slots[i]));                                    \
+    return dead;                                                               \
+  }
+
+#else
+
+// robin hood probing, `d` is one more than how far a key sits past its
+// home slot and 0 in an empty slot, an insert takes the slot of any key
+// closer to home than itself, so a lookup can stop at the first key
+// closer to home than the probe is, and a delete shifts the run behind
+// it back one slot instead of leaving a tombstone
+#define hash_table_probe(T, pre, K, V, hash, eq)                               \
+  static inline T##Slot *pre##alloc(int cap) {                                 \
+    return calloc(cap, sizeof(T##Slot));                                       \
+  }                                                                            \
+                                                                               \
+  /* index of `k` in the `cap` slots at `slots`, -1 if it is not there, */     \
+  /* only a key at exactly the probe distance can be `k` */                    \
+  static inline int pre##find(const T##Slot *slots, int cap, uint64_t h,       \
+                              K k) {                                           \
+    int i = h & (cap - 1);                                                     \
+    for (int d = 1; slots[i].d >= d; ++d) {                                    \
+      if (slots[i].d == d && eq(slots[i].k, k))                                \
+        return i;                                                              \
+      i = (i + 1) & (cap - 1);                                                 \
+    }                                                                          \
+    return -1;                                                                 \
+  }                                                                            \
+                                                                               \
+  /* `k` must not be in the table yet, the load limit keeps a free slot */     \
+  static inline void pre##insert(T *ht, uint64_t h, K k, V v) {                \
+    T##Slot e = {k, v, 1};                                                     \
+    int i = h & (ht->cap - 1);                                                 \
+    while (ht->kvs[i].d) {                                                     \
+      if (ht->kvs[i].d < e.d) {                                                \
+        const T##Slot t = ht->kvs[i];                                          \
+        ht->kvs[i] = e;                                                        \
+        e = t;                                                                 \
+      }                                                                        \
+      i = (i + 1) & (ht->cap - 1);                                             \
+      e.d += 1;                                                                \
+    }                                                                          \
+    ht->kvs[i] = e;                                                            \
+  }                                                                            \
+                                                                               \
+  /* close the gap at `i`, every key after it up to the next empty slot */     \
+  /* or key already at home moves one slot closer to home, no tombstone */     \
+  /* is left */                                                                \
+  static inline bool pre##remove(T##Slot *slots, int cap, int i) {             \
+    int j = (i + 1) & (cap - 1);                                               \
+    while (slots[j].d > 1) {                                                   \
+      slots[i] = slots[j];                                                     \
+      slots[i].d -= 1;                                                         \
+      i = j;                                                                   \
+      j = (j + 1) & (cap - 1);                                                 \
+    }                                                                          \
+    memset(&slots[i], 0, sizeof(slots[i]));                                    \
+    return false;                                                              \
+  }
+
+#endif
+
+// the swiss mode keeps `d` at 1 in a full slot, `old` holds the slots from
+// `moved` on that a resize has not moved yet, lookups check it after kvs
+// until it is gone, the pages below slot `released` are handed back already
+#define hash_table_template(T, pre, K, V, hash, eq)                            \
+  typedef struct {                                                             \
+    K k;                                                                       \
+    V v;                                                                       \
+    int d;                                                                     \
+  } T##Slot;                                                                   \
+                                                                               \
+  typedef struct {                                                             \
+    T##Slot *kvs;                                                              \
+    T##Slot *old;                                                              \
+    uint64_t seed;                                                             \
+    int e;                                                                     \
+    int size;                                                                  \
+    int dead;                                                                  \
+    int cap;                                                                   \
+    int old_cap;                                                               \
+    int moved;                                                                 \
+    int released;                                                              \
+  } T;                                                                         \
+                                                                               \
+  hash_table_probe(T, pre, K, V, hash, eq)                                     \
+                                                                               \
+  /* the cursor only advances over a free slot, with robin hood the shift */   \
+  /* that follows taking a key out may move the next one into it, keys */      \
+  /* only ever shift to lower slots so none can slip behind the cursor, */     \
+  /* the slots behind it stay empty and a lookup of a key with its home */     \
+  /* there stops right away, so they can go */                                 \
+  static inline void pre##rehash(T *ht, int steps) {                           \
+    if (!ht->old)                                                              \
+      return;                                                                  \
+    for (; steps > 0 && ht->moved < ht->old_cap; --steps) {                    \
+      const T##Slot *e = &ht->old[ht->moved];                                  \
+      if (e->d) {                                                              \
+        pre##insert(ht, hash(e->k, ht->seed), e->k, e->v);                     \
+        pre##remove(ht->old, ht->old_cap, ht->moved);                          \
+      } else {                                                                 \
+        ht->moved += 1;                                                        \
+      }                                                                        \
+    }                                                                          \
+    if (ht->moved == ht->old_cap) {                                            \
+      free(ht->old);                                                           \
+      ht->old = NULL;                                                          \
+    } else if ((size_t)(ht->moved - ht->released) * sizeof(T##Slot) >=         \
+               HASH_RELEASE_BYTES) {                                           \
+      ht->released += hash_release(ht->old + ht->released,                     \
+                                   (ht->moved - ht->released) *                \
+                                       sizeof(T##Slot)) /                      \
+                      sizeof(T##Slot);                                         \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  /* a resize still in progress is finished first, the rehash step is */       \
+  /* sized so that only happens after a burst of deletes */                    \
+  static inline bool pre##resize(T *ht, int exp) {                             \
+    pre##rehash(ht, INT32_MAX);                                                \
+    T##Slot *slots = pre##alloc(1 << exp);                                     \
+    if (!slots)                                                                \
+      return false;                                                            \
+    ht->old = ht->kvs;                                                         \
+    ht->old_cap = ht->cap;                                                     \
+    ht->moved = 0;                                                             \
+    ht->released = 0;                                                          \
+    ht->kvs = slots;                                                           \
+    ht->e = exp;                                                               \
+    ht->dead = 0;                                                              \
+    ht->cap = 1 << exp;                                                        \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  /* every table gets a seed of its own and at least 1 << HASH_EXP_MIN */      \
+  /* slots, which start out empty */                                           \
+  static inline bool pre##init(T *ht, int exp) {                               \
+    assert(exp >= 0);                                                          \
+    exp = exp < HASH_EXP_MIN ? HASH_EXP_MIN : exp;                             \
+    *ht = (T){.seed = hash_seed(), .e = exp, .cap = 1 << exp};                 \
+    ht->kvs = pre##alloc(ht->cap);                                             \
+    return ht->kvs != NULL;                                                    \
+  }                                                                            \
+                                                                               \
+  static inline void pre##free(T *ht) {                                        \
+    free(ht->kvs);                                                             \
+    free(ht->old);                                                             \
+  }                                                                            \
+                                                                               \
+  /* the value stays where it is until the next set or del */                  \
+  static inline V *pre##get(const T *ht, K k) {                                \
+    const uint64_t h = hash(k, ht->seed);                                      \
+    int i = pre##find(ht->kvs, ht->cap, h, k);                                 \
+    if (i >= 0)                                                                \
+      return &ht->kvs[i].v;                                                    \
+    if (ht->old && (i = pre##find(ht->old, ht->old_cap, h, k)) >= 0)           \
+      return &ht->old[i].v;                                                    \
+    return NULL;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline bool pre##set(T *ht, K k, V v) {                               \
+    const uint64_t h = hash(k, ht->seed);                                      \
+    int i = pre##find(ht->kvs, ht->cap, h, k);                                 \
+    if (i >= 0) {                                                              \
+      ht->kvs[i].v = v;                                                        \
+    } else if (ht->old && (i = pre##find(ht->old, ht->old_cap, h, k)) >= 0) {  \
+      ht->old[i].v = v;                                                        \
+    } else {                                                                   \
+      /* tombstones alone only call for a rebuild at the same size */          \
+      if ((ht->size + ht->dead + 1) * 8 > ht->cap * HASH_LOAD_MAX) {           \
+        const bool grow = (ht->size + 1) * 16 > ht->cap * HASH_LOAD_MAX;       \
+        if (!pre##resize(ht, grow ? ht->e + 1 : ht->e))                        \
+          return false;                                                        \
+      }                                                                        \
+      pre##insert(ht, h, k, v);                                                \
+      ht->size += 1;                                                           \
+    }                                                                          \
+    pre##rehash(ht, HASH_REHASH_STEP);                                         \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline bool pre##del(T *ht, K k) {                                    \
+    const uint64_t h = hash(k, ht->seed);                                      \
+    int i = pre##find(ht->kvs, ht->cap, h, k);                                 \
+    if (i >= 0) {                                                              \
+      ht->dead += pre##remove(ht->kvs, ht->cap, i);                            \
+    } else if (ht->old && (i = pre##find(ht->old, ht->old_cap, h, k)) >= 0) {  \
+      pre##remove(ht->old, ht->old_cap, i);                                    \
+    } else {                                                                   \
+      return false;                                                            \
+    }                                                                          \
+    ht->size -= 1;                                                             \
+    if (ht->size * 16 < ht->cap * HASH_LOAD_MIN && ht->e > HASH_EXP_MIN)       \
+      pre##resize(ht, ht->e - 1);                                              \
+    pre##rehash(ht, HASH_REHASH_STEP);                                         \
+    return true;                                                               \
+  }
+
+#endif // HASH_TABLE_H_
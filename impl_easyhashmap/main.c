@@ -1,27 +1,12 @@
-#include <assert.h>
+#define _DEFAULT_SOURCE
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
-#define hash_table_template(items)                                             \
-  typedef struct {                                                             \
-    items kvs;                                                                 \
-    hash h;                                                                    \
-    int e;                                                                     \
-    int size;                                                                  \
-    int cap;                                                                   \
-  } HashTable
-
-#define hash_table_init(ht, hash, exp)                                         \
-  do {                                                                         \
-    assert(exp >= 0);                                                          \
-    (ht)->kvs = malloc(sizeof(*(ht)->kvs) * (1 << exp));                       \
-    (ht)->h = hash;                                                            \
-    (ht)->e = exp;                                                             \
-    (ht)->size = 0;                                                            \
-    (ht)->cap = (1 << exp);                                                    \
-  } while (0)
+#include "hash.h"
+#include "hash_table.h"
 
 // user code
 typedef struct {
@@ -29,18 +14,11 @@ typedef struct {
   int l;
 } str;
 
-typedef struct {
-  str k;
-  int v;
-  int d;
-} kv;
-typedef kv *kvs;
-
-typedef uint64_t (*hash)(str);
-uint64_t dumb_hash(str k) { return 1; }
-hash_table_template(kvs);
+static inline uint64_t str_hash(str k, uint64_t seed) {
+  return hash_wy(k.p, k.l, seed);
+}
 
-bool streq(str k1, str k2) {
+static inline bool streq(str k1, str k2) {
   if (k1.l != k2.l)
     return false;
   for (int i = 0; i < k1.l; ++i) {
@@ -50,67 +28,39 @@ bool streq(str k1, str k2) {
   return true;
 }
 
-void hprint(const HashTable *ht) {
-  printf("Hash Table: \n");
-  for (int i = 0; i < ht->cap; ++i) {
-    printf("  slot %d: %s => %d [%d]\n", i, ht->kvs[i].k.p, ht->kvs[i].v,
-           ht->kvs[i].d);
-  }
+static inline uint64_t int_hash(int k, uint64_t seed) {
+  return hash_u64((uint32_t)k, seed);
 }
 
-int hget(const HashTable *ht, str k) {
-  int cnt = 0;
-  int i = ht->h(k) % ht->cap;
-  while (cnt++ < ht->cap && (ht->kvs[i].k.p || ht->kvs[i].d)) {
-    if (!ht->kvs[i].d && streq(ht->kvs[i].k, k))
-      return ht->kvs[i].v;
-    i = (i + 1) % ht->cap;
-  }
-  return -1;
+static inline bool int_eq(int a, int b) { return a == b; }
+
+static inline uint64_t ptr_hash(const void *k, uint64_t seed) {
+  return hash_u64((uintptr_t)k, seed);
 }
 
-bool hset(HashTable *ht, str k, int v) {
-  int cnt = 0;
-  int i = ht->h(k) % ht->cap;
-  while (cnt++ < ht->cap) {
-    if (streq(ht->kvs[i].k, k)) {
-      ht->kvs->v = v;
-      return true;
-    }
-    if (!ht->kvs[i].k.p)
-      break;
-    i = (i + 1) % ht->cap;
-  }
-  if (!ht->kvs[i].k.p) {
-    ht->kvs[i].k = k;
-    ht->kvs[i].v = v;
-    ht->kvs[i].d = 0;
-    ht->size += 1;
-    return true;
+static inline bool ptr_eq(const void *a, const void *b) { return a == b; }
+
+hash_table_template(HashTable, h, str, int, str_hash, streq)
+hash_table_template(IntTable, ih, int, int, int_hash, int_eq)
+hash_table_template(PtrTable, ph, const void *, int, ptr_hash, ptr_eq)
+
+void hprint(const HashTable *ht) {
+  printf("Hash Table: \n");
+  for (int i = 0; i < ht->cap; ++i) {
+    printf("  slot %d: %.*s => %d [%d]\n", i, ht->kvs[i].k.l, ht->kvs[i].k.p,
+           ht->kvs[i].v, ht->kvs[i].d);
   }
-  return false;
 }
 
-bool hdel(HashTable *ht, str k) {
-  int cnt = 0;
-  int i = ht->h(k) % ht->cap;
-  while (cnt++ < ht->cap) {
-    if (streq(ht->kvs[i].k, k)) {
-      ht->kvs[i].k.p = NULL;
-      ht->kvs[i].k.l = 0;
-      ht->kvs[i].v = 0;
-      ht->kvs[i].d = 1;
-      ht->size -= 1;
-      return true;
-    }
-    i = (i + 1) % ht->cap;
-  }
-  return false;
+static uint64_t clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
 int main(void) {
   HashTable ht;
-  hash_table_init(&ht, dumb_hash, 3);
+  hinit(&ht, 3);
   str d = {"urdad", 5};
   if (hset(&ht, d, 1)) {
   }
@@ -124,11 +74,89 @@ int main(void) {
   str mm = {"urmom", 5};
   hdel(&ht, mm);
   str nn = {"urnan", 5};
-  if (hget(&ht, nn) != -1) {
+  if (hget(&ht, nn) != NULL) {
     printf("success del\n");
   }
   hdel(&ht, mm);
   hprint(&ht);
+  hfree(&ht);
+
+  // a million keys into a table that starts at 8 slots and back out, the
+  // slowest single call shows what a resize costs
+  enum { NUM_KEYS = 1000000, KEY_LEN = 16 };
+  char *keys = malloc(NUM_KEYS * KEY_LEN);
+  hinit(&ht, HASH_EXP_MIN);
+  uint64_t worst = 0;
+  for (int i = 0; i < NUM_KEYS; ++i) {
+    str k = {keys + i * KEY_LEN, snprintf(keys + i * KEY_LEN, KEY_LEN,
+                                          "key-%d", i)};
+    const uint64_t start = clock_ns();
+    hset(&ht, k, i);
+    const uint64_t ns = clock_ns() - start;
+    worst = ns > worst ? ns : worst;
+  }
+  int found = 0;
+  for (int i = 0; i < NUM_KEYS; i += 7) {
+    str k = {keys + i * KEY_LEN, snprintf(keys + i * KEY_LEN, KEY_LEN,
+                                          "key-%d", i)};
+    const int *v = hget(&ht, k);
+    found += v && *v == i;
+  }
+  printf("Grow: %d keys, cap %d, found %d, worst hset %llu ns\n", ht.size,
+         ht.cap, found, (unsigned long long)worst);
+  // a miss walks the whole probe sequence, it is where the two probing
+  // schemes differ most
+  char miss[KEY_LEN];
+  int missed = 0;
+  const uint64_t start = clock_ns();
+  for (int i = 0; i < NUM_KEYS; ++i) {
+    str k = {miss, snprintf(miss, KEY_LEN, "miss-%d", i)};
+    missed += hget(&ht, k) == NULL;
+  }
+  printf("Miss: %d keys, %.1f ns/lookup\n", missed,
+         (double)(clock_ns() - start) / NUM_KEYS);
+  for (int i = 0; i < NUM_KEYS - 10; ++i) {
+    str k = {keys + i * KEY_LEN, snprintf(keys + i * KEY_LEN, KEY_LEN,
+                                          "key-%d", i)};
+    hdel(&ht, k);
+  }
+  printf("Shrink: %d keys, cap %d\n", ht.size, ht.cap);
+  hfree(&ht);
+  free(keys);
+
+  // the same table over integer and pointer keys, hash and compare inline
+  // into the probe loop instead of going through a pointer
+  IntTable it;
+  ihinit(&it, HASH_EXP_MIN);
+  for (int i = 0; i < NUM_KEYS; ++i)
+    ihset(&it, i * 7, i);
+  found = 0;
+  uint64_t t = clock_ns();
+  for (int i = 0; i < NUM_KEYS; ++i) {
+    const int *v = ihget(&it, i * 7);
+    found += v && *v == i;
+  }
+  printf("Int: %d keys, found %d, %.1f ns/lookup\n", it.size, found,
+         (double)(clock_ns() - t) / NUM_KEYS);
+  ihfree(&it);
+
+  enum { NUM_PTRS = 1000 };
+  void *ptrs[NUM_PTRS];
+  PtrTable pt;
+  phinit(&pt, HASH_EXP_MIN);
+  for (int i = 0; i < NUM_PTRS; ++i) {
+    ptrs[i] = malloc(32);
+    phset(&pt, ptrs[i], i);
+  }
+  found = 0;
+  for (int i = 0; i < NUM_PTRS; ++i) {
+    const int *v = phget(&pt, ptrs[i]);
+    found += v && *v == i;
+    phdel(&pt, ptrs[i]);
+    free(ptrs[i]);
+  }
+  printf("Ptr: found %d, left %d\n", found, pt.size);
+  phfree(&pt);
 
   return 0;
 }
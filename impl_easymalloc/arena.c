@@ -0,0 +1,95 @@
+#include <stdalign.h>
+
+#include "arena.h"
+#include "easymalloc.h"
+
+#define ARENA_ALIGN alignof(max_align_t)
+#define ARENA_BLOCK_DEFAULT (64 * 1024)
+
+static size_t arena_round(size_t size) {
+  return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static char *arena_block_data(ArenaBlock *b) {
+  return (char *)b + arena_round(sizeof(ArenaBlock));
+}
+
+static void arena_enter(Arena *a, ArenaBlock *b) {
+  a->cur = b;
+  a->ptr = arena_block_data(b);
+  a->end = a->ptr + b->size;
+}
+
+void arena_init(Arena *a, size_t block_size) {
+  a->first = NULL;
+  a->cur = NULL;
+  a->ptr = NULL;
+  a->end = NULL;
+  a->block_size = block_size > 0 ? block_size : ARENA_BLOCK_DEFAULT;
+}
+
+// move on to the next kept block if it fits, otherwise chain a new one
+// right after the current block
+static void *arena_alloc_slow(Arena *a, size_t size) {
+  ArenaBlock *next = a->cur != NULL ? a->cur->next : a->first;
+  if (next == NULL || next->size < size) {
+    const size_t bsize = size > a->block_size ? size : a->block_size;
+    ArenaBlock *b = heap_alloc(arena_round(sizeof(ArenaBlock)) + bsize);
+    if (b == NULL)
+      return NULL;
+    // the heap rounds up, the slack is free room for the arena
+    b->size = heap_usable_size(b) - arena_round(sizeof(ArenaBlock));
+    b->next = next;
+    if (a->cur != NULL) {
+      a->cur->next = b;
+    } else {
+      a->first = b;
+    }
+    next = b;
+  }
+
+  arena_enter(a, next);
+  void *ret = a->ptr;
+  a->ptr += size;
+  return ret;
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+  size = arena_round(size);
+  if (size <= (size_t)(a->end - a->ptr)) {
+    void *ret = a->ptr;
+    a->ptr += size;
+    return ret;
+  }
+  return arena_alloc_slow(a, size);
+}
+
+ArenaMark arena_save(const Arena *a) {
+  return (ArenaMark){.block = a->cur, .ptr = a->ptr};
+}
+
+void arena_restore(Arena *a, ArenaMark mark) {
+  if (mark.block == NULL) {
+    arena_reset(a);
+    return;
+  }
+  a->cur = mark.block;
+  a->ptr = mark.ptr;
+  a->end = arena_block_data(mark.block) + mark.block->size;
+}
+
+void arena_reset(Arena *a) {
+  if (a->first == NULL)
+    return;
+  arena_enter(a, a->first);
+}
+
+void arena_destroy(Arena *a) {
+  ArenaBlock *b = a->first;
+  while (b != NULL) {
+    ArenaBlock *next = b->next;
+    heap_free(b);
+    b = next;
+  }
+  arena_init(a, a->block_size);
+}
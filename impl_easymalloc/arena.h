@@ -0,0 +1,35 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+// bump allocator for objects that die together, the blocks come from
+// heap_alloc and stay chained until arena_destroy so that restoring a mark
+// or resetting never touches the heap
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t size;
+} ArenaBlock;
+
+typedef struct {
+  ArenaBlock *first;
+  ArenaBlock *cur;
+  char *ptr;
+  char *end;
+  size_t block_size;
+} Arena;
+
+// savepoints nest, restoring one drops everything allocated after it
+typedef struct {
+  ArenaBlock *block;
+  char *ptr;
+} ArenaMark;
+
+void arena_init(Arena *a, size_t block_size);
+void *arena_alloc(Arena *a, size_t size);
+ArenaMark arena_save(const Arena *a);
+void arena_restore(Arena *a, ArenaMark mark);
+void arena_reset(Arena *a);
+void arena_destroy(Arena *a);
+
+#endif // ARENA_H_
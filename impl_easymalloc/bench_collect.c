@@ -0,0 +1,114 @@
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "easymalloc.h"
+
+// NUM_GRAPH random binary trees of `n` nodes in all, one stays reachable
+// from a global and the rest are dropped, then released either by walking
+// each dropped tree and calling heap_free on every node or by a single
+// heap_collect
+//
+//   ./bench_collect [NODES]
+#define NUM_GRAPH 8
+
+typedef struct Node {
+  struct Node *left;
+  struct Node *right;
+  char payload[];
+} Node;
+
+static Node *roots[NUM_GRAPH];
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned xorshift(unsigned *s) {
+  *s ^= *s << 13;
+  *s ^= *s >> 17;
+  *s ^= *s << 5;
+  return *s;
+}
+
+// nodes hang off a random earlier node, so the trees come out bushy and
+// their nodes spread over the whole heap
+static void build(size_t n, unsigned seed) {
+  Node **nodes = malloc(n * sizeof(Node *));
+  for (size_t i = 0; i < n; i++) {
+    const unsigned r = xorshift(&seed);
+    nodes[i] = heap_alloc(sizeof(Node) + 8 + r % 48);
+    nodes[i]->left = nodes[i]->right = NULL;
+    if (i < NUM_GRAPH) {
+      roots[i] = nodes[i];
+      continue;
+    }
+    Node *parent = nodes[(r >> 8) % i];
+    while (parent->left != NULL && parent->right != NULL)
+      parent = (r >> 20) & 1 ? parent->left : parent->right;
+    if (parent->left == NULL) {
+      parent->left = nodes[i];
+    } else {
+      parent->right = nodes[i];
+    }
+  }
+  memset(nodes, 0, n * sizeof(Node *));
+  free(nodes);
+}
+
+static size_t free_tree(Node *root, Node **stack) {
+  size_t freed = 0, top = 0;
+  if (root != NULL)
+    stack[top++] = root;
+  while (top > 0) {
+    Node *n = stack[--top];
+    if (n->left != NULL)
+      stack[top++] = n->left;
+    if (n->right != NULL)
+      stack[top++] = n->right;
+    heap_free(n);
+    freed += 1;
+  }
+  return freed;
+}
+
+int main(int argc, char *argv[]) {
+  const size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  Node **stack = malloc(n * sizeof(Node *));
+
+  build(n, 12345);
+  double start = now();
+  size_t freed = 0;
+  for (size_t g = 1; g < NUM_GRAPH; g++) {
+    freed += free_tree(roots[g], stack);
+    roots[g] = NULL;
+  }
+  const double walk = now() - start;
+  heap_flush();
+  free_tree(roots[0], stack);
+  roots[0] = NULL;
+  heap_flush();
+
+  build(n, 12345);
+  for (size_t g = 1; g < NUM_GRAPH; g++)
+    roots[g] = NULL;
+  start = now();
+  const HeapCollectStats stats = heap_collect();
+  const double collect = now() - start;
+
+  printf("%-12s %10s %10s %10s\n", "", "blocks", "ms", "ns/block");
+  printf("%-12s %10zu %10.2f %10.1f\n", "heap_free", freed, walk * 1e3,
+         walk * 1e9 / freed);
+  printf("%-12s %10zu %10.2f %10.1f\n", "heap_collect", stats.blocks_freed,
+         collect * 1e3, collect * 1e9 / stats.blocks_freed);
+  printf("%zu blocks live after collect\n", stats.blocks_live);
+
+  free_tree(roots[0], stack);
+  free(stack);
+  return 0;
+}
@@ -0,0 +1,103 @@
+#define _DEFAULT_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "easymalloc.h"
+
+// every thread owns NUM_SLOT slots and keeps replacing a random one, so
+// about half of the operations are allocations and half are frees
+#define NUM_SLOT 1024
+#define SIZE_MIN 8
+#define SIZE_MAX_BENCH 512
+
+typedef struct {
+  const char *name;
+  void *(*alloc)(size_t);
+  void (*free)(void *);
+} Allocator;
+
+typedef struct {
+  const Allocator *a;
+  size_t ops;
+  unsigned seed;
+} Worker;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned xorshift(unsigned *s) {
+  *s ^= *s << 13;
+  *s ^= *s >> 17;
+  *s ^= *s << 5;
+  return *s;
+}
+
+static void *worker(void *arg) {
+  Worker *w = arg;
+  void *slots[NUM_SLOT] = {0};
+  for (size_t i = 0; i < w->ops; i++) {
+    const unsigned r = xorshift(&w->seed);
+    void **slot = &slots[r % NUM_SLOT];
+    if (*slot != NULL) {
+      w->a->free(*slot);
+      *slot = NULL;
+    } else {
+      const size_t size = SIZE_MIN + (r >> 10) % (SIZE_MAX_BENCH - SIZE_MIN);
+      *slot = w->a->alloc(size);
+      memset(*slot, 0, SIZE_MIN);
+    }
+  }
+  for (size_t i = 0; i < NUM_SLOT; i++)
+    w->a->free(slots[i]);
+  return NULL;
+}
+
+// total operations per second with `n` threads doing `ops` each
+static double run(const Allocator *a, size_t n, size_t ops) {
+  pthread_t threads[n];
+  Worker workers[n];
+  const double start = now();
+  for (size_t i = 0; i < n; i++) {
+    workers[i] = (Worker){.a = a, .ops = ops, .seed = 2463534242u + i};
+    pthread_create(&threads[i], NULL, worker, &workers[i]);
+  }
+  for (size_t i = 0; i < n; i++)
+    pthread_join(threads[i], NULL);
+  return n * ops / (now() - start);
+}
+
+int main(int argc, char *argv[]) {
+  const long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  const size_t max = argc > 1 ? strtoul(argv[1], NULL, 10) : (size_t)ncpu;
+  const size_t ops = argc > 2 ? strtoul(argv[2], NULL, 10) : 2000000;
+  const Allocator allocators[] = {
+      {"easymalloc", heap_alloc, heap_free},
+      {"glibc", malloc, free},
+  };
+
+  printf("cpus: %ld, ops per thread: %zu\n", ncpu, ops);
+  printf("%-8s", "threads");
+  for (size_t a = 0; a < 2; a++)
+    printf(" %14s Mops/s %7s", allocators[a].name, "scale");
+  printf("\n");
+  double base[2] = {0};
+  for (size_t n = 1; n <= max; n *= 2) {
+    printf("%-8zu", n);
+    for (size_t a = 0; a < 2; a++) {
+      const double tput = run(&allocators[a], n, ops);
+      if (n == 1)
+        base[a] = tput;
+      printf(" %21.2f %6.2fx", tput / 1e6, tput / base[a]);
+    }
+    printf("\n");
+  }
+  return 0;
+}
@@ -0,0 +1,78 @@
+#define _DEFAULT_SOURCE
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "easymalloc.h"
+
+// `num_vec` vectors of ints take turns appending one element each, every
+// full vector grows its capacity by half with realloc, with `usable` set it
+// then takes whatever the allocator rounded up to as capacity
+typedef struct {
+  const char *name;
+  void *(*realloc)(void *, size_t);
+  void (*free)(void *);
+  size_t (*usable_size)(void *);
+} Allocator;
+
+typedef struct {
+  int *items;
+  size_t len;
+  size_t cap;
+} Vec;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const Allocator *a, size_t num_vec, size_t len, int usable) {
+  Vec vecs[num_vec];
+  for (size_t v = 0; v < num_vec; v++)
+    vecs[v] = (Vec){0};
+
+  size_t grows = 0, moves = 0;
+  const double start = now();
+  for (size_t i = 0; i < len; i++) {
+    for (size_t v = 0; v < num_vec; v++) {
+      Vec *vec = &vecs[v];
+      if (vec->len == vec->cap) {
+        vec->cap = vec->cap < 4 ? 4 : vec->cap + vec->cap / 2;
+        int *items = a->realloc(vec->items, vec->cap * sizeof(int));
+        moves += vec->items != NULL && items != vec->items;
+        grows += 1;
+        vec->items = items;
+        if (usable)
+          vec->cap = a->usable_size(items) / sizeof(int);
+      }
+      vec->items[vec->len++] = (int)i;
+    }
+  }
+  const double elapsed = now() - start;
+
+  for (size_t v = 0; v < num_vec; v++)
+    a->free(vecs[v].items);
+  printf("%-10s %6s %8zu %10zu %10.2f %8zu %8zu %8.1f%%\n", a->name,
+         usable ? "usable" : "asked", num_vec, len,
+         elapsed * 1e9 / (num_vec * len), grows, moves, 100.0 * moves / grows);
+}
+
+int main(int argc, char *argv[]) {
+  const size_t total = argc > 1 ? strtoul(argv[1], NULL, 10) : 1 << 24;
+  const Allocator allocators[] = {
+      {"easymalloc", heap_realloc, heap_free, heap_usable_size},
+      {"glibc", realloc, free, malloc_usable_size},
+  };
+
+  printf("%-10s %6s %8s %10s %10s %8s %8s %9s\n", "allocator", "cap",
+         "vectors", "length", "ns/append", "grows", "moves", "moved");
+  for (size_t num_vec = 1; num_vec <= 256; num_vec *= 16) {
+    for (size_t a = 0; a < 2; a++) {
+      run(&allocators[a], num_vec, total / num_vec, 0);
+      run(&allocators[a], num_vec, total / num_vec, 1);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,2419 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <link.h>
+#include <math.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "easymalloc.h"
+
+#define DBG false
+// the heap reserves HEAP_RESERVE bytes of address space up front and makes
+// them usable in page-sized segments, at least HEAP_GROW_MIN at a time
+#define HEAP_RESERVE (1ull << 36)
+#define HEAP_GROW_MIN (64 * 1024)
+// blocks of HEAP_MMAP_THRESHOLD bytes and up get a mapping of their own
+#define HEAP_MMAP_THRESHOLD (256 * 1024)
+// with transparent huge pages the heap grows a whole huge page at a time
+#define HEAP_HUGEPAGE (2 * 1024 * 1024)
+// blocks are rounded up to a multiple of SIZE_CLASS_STEP, free blocks up to
+// SIZE_CLASS_MAX live in the matching bin, anything larger in chunks_free,
+// the step is also the alignment every payload gets
+#define SIZE_CLASS_STEP 16
+#define NUM_SIZE_CLASS 64
+#define SIZE_CLASS_MAX (SIZE_CLASS_STEP * NUM_SIZE_CLASS)
+// every block starts with a header word holding its size and flags, a free
+// block repeats its size in the last word so the next block can find it,
+// sampled blocks have an entry in the profile, mapped blocks live outside the
+// heap and have no neighbours
+#define BLOCK_INUSE 1
+#define BLOCK_PREV_INUSE 2
+#define BLOCK_SAMPLED 4
+#define BLOCK_MMAPPED 8
+#define BLOCK_FLAGS                                                            \
+  (BLOCK_INUSE | BLOCK_PREV_INUSE | BLOCK_SAMPLED | BLOCK_MMAPPED)
+// blocks carved for a thread cache carry its id in the top bits of the
+// header, any rewrite of the header may drop it and the block is then
+// nobody's, id 0, a free chunk that a trim already went over carries
+// BLOCK_TRIMMED just below the id until its header is rewritten
+#define BLOCK_OWNER_SHIFT 48
+#define BLOCK_TRIMMED (1ull << (BLOCK_OWNER_SHIFT - 1))
+#define BLOCK_SIZE_MASK ((BLOCK_TRIMMED - 1) & ~BLOCK_FLAGS)
+#define MAX_OWNERS (1 << (64 - BLOCK_OWNER_SHIFT))
+#define BLOCK_HEADER sizeof(size_t)
+#define BLOCK_MIN (sizeof(FreeBlock) + sizeof(size_t))
+// each thread keeps up to TCACHE_LIMIT freed blocks per size class and
+// moves TCACHE_BATCH of them at a time from and to the central heap
+#define TCACHE_LIMIT 64
+#define TCACHE_BATCH 16
+// chunks_free is a B+tree of CHUNK_FANOUT wide nodes, a node is at least a
+// quarter full so CHUNK_DEPTH levels are never reached, building with
+// HEAP_CHUNK_LIST falls back to an address sorted array
+#define CHUNK_FANOUT 16
+#define CHUNK_DEPTH 32
+// once HEAP_TRIM_THRESHOLD bytes went back into free chunks the background
+// trimmer waits HEAP_TRIM_DELAY_MS, so that churn can pick them up again,
+// and then hands their pages back to the OS, MADV_FREE is cheaper but only
+// lowers RSS once the kernel runs short of memory
+#define HEAP_TRIM_THRESHOLD (4 * 1024 * 1024)
+#define HEAP_TRIM_DELAY_MS 100
+#ifndef HEAP_TRIM_ADVICE
+#define HEAP_TRIM_ADVICE MADV_DONTNEED
+#endif
+// one call in STATS_SAMPLE per thread is timed for the latency histograms
+#define STATS_SAMPLE 64
+// the profile holds up to PROFILE_SLOTS / 2 live samples of at most
+// PROFILE_DEPTH frames each
+#define PROFILE_BITS 14
+#define PROFILE_SLOTS (1 << PROFILE_BITS)
+#define PROFILE_DEPTH 32
+// trace events are buffered and written out TRACE_BUF_LEN at a time
+#define TRACE_BUF_LEN 4096
+#define UNIMPLEMENTED()                                                        \
+  do {                                                                         \
+    fprintf(stderr,                                                            \
+            "[TODO] %s:%d func %s has not been implemented "                   \
+            "yet.\n",                                                          \
+            __FILE__, __LINE__, __func__);                                     \
+    abort();                                                                   \
+  } while (0)
+#define DEBUG(msg)                                                             \
+  if (DBG)                                                                     \
+  printf("[DEBUG] %s:%d %s\n", __FILE__, __LINE__, msg)
+
+typedef struct {
+  void *start;
+  size_t size;
+} Chunk;
+
+_Static_assert(SIZE_CLASS_STEP % _Alignof(max_align_t) == 0,
+               "payloads must be aligned for any object");
+
+// layout of a free block, next/prev are only meaningful while it sits in a
+// bin, an allocated block keeps nothing but the header, which the owner
+// reads without heap_lock while a neighbour under the lock flips its
+// BLOCK_PREV_INUSE, so it is only touched through the header_ helpers
+typedef struct FreeBlock {
+  _Atomic size_t header;
+  struct FreeBlock *next;
+  struct FreeBlock *prev;
+} FreeBlock;
+
+enum { STATS_ALLOC, STATS_FREE, STATS_REALLOC, NUM_STATS_OP };
+
+// counters of one thread, only the owner writes them and heap_stats reads
+// them from anywhere, see counter_add
+typedef struct {
+  _Atomic uint64_t calls[NUM_STATS_OP];
+  _Atomic uint64_t latency[NUM_STATS_OP][HEAP_STATS_BUCKETS];
+  _Atomic uint64_t bytes_cached;
+} Counters;
+
+// a mapped block starts `len` bytes of its own, the links in front of the
+// header put the payload on a SIZE_CLASS_STEP boundary, an aligned one may
+// start inside the first page of its mapping
+typedef struct Mapping {
+  struct Mapping *next;
+  struct Mapping *prev;
+  size_t len;
+  _Atomic size_t header;
+} Mapping;
+
+// freed small blocks stay marked in use while cached, so the central heap
+// never merges them, bins[c] is singly linked through next, other threads
+// hand blocks owned by this cache back through `remote`, a lock-free stack
+// on a cache line of its own that only the owner empties, frees for one
+// owner are chained up in `pending` and pushed with a single exchange,
+// caches outlive their threads and get reused by new ones so a late remote
+// free never lands in unmapped memory
+typedef struct TCache {
+  FreeBlock *bins[NUM_SIZE_CLASS];
+  size_t counts[NUM_SIZE_CLASS];
+  Counters stats;
+  uint64_t ops;
+  int64_t sample_left;
+  uint64_t rng;
+  uint32_t id;
+  uint32_t pending_owner;
+  size_t pending_count;
+  FreeBlock *pending;
+  FreeBlock *pending_tail;
+  struct TCache *next;
+  struct TCache *idle;
+  _Alignas(64) _Atomic(FreeBlock *) remote;
+  char remote_pad[64 - sizeof(FreeBlock *)];
+} TCache;
+
+// everything below up to the thread caches is the central heap, guarded by
+// heap_lock
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;
+static _Thread_local TCache *tcache = NULL;
+static TCache *tcaches = NULL;
+static TCache *tcaches_idle = NULL;
+static size_t tcaches_live = 0;
+static TCache **owners = NULL;
+static uint32_t owners_len = 1;
+static void tcache_destroy(void *arg);
+// counters of exited threads and of the central heap
+static Counters retired = {0};
+static uint64_t merges = 0;
+
+// while trace_fd is open every public entry point appends one event
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int trace_fd = -1;
+static HeapTraceEvent *trace_buf = NULL;
+static size_t trace_len = 0;
+static uint64_t trace_start = 0;
+
+// one live sampled block, `weight` is the number of allocated bytes it
+// stands for
+typedef struct {
+  uintptr_t ptr;
+  size_t size;
+  double weight;
+  int depth;
+  void *frames[PROFILE_DEPTH];
+} Sample;
+
+// sampling is on while profile_rate is non-zero, profile is an open
+// addressing table keyed by payload address
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t profile_rate = 0;
+static atomic_bool profile_used = false;
+static Sample *profile = NULL;
+static size_t profile_len = 0;
+static _Thread_local bool profile_busy = false;
+
+static char *heap = NULL;
+static size_t heap_size = 0;
+static size_t heap_grow_min = HEAP_GROW_MIN;
+static size_t page_size = 0;
+
+static Mapping *mappings = NULL;
+static size_t mappings_size = 0;
+
+// bins[c] holds free blocks of exactly class_size(c) bytes, bit c of
+// bins_bitmap is set iff bins[c] is non-empty
+static FreeBlock *bins[NUM_SIZE_CLASS] = {0};
+static uint64_t bins_bitmap = 0;
+
+// bytes freed into chunks since the last trim, the trimmer sleeps on
+// trim_cond with heap_lock
+static pthread_cond_t trim_cond = PTHREAD_COND_INITIALIZER;
+static size_t trim_pending = 0;
+static bool trim_running = false;
+// bit p is set while page p of the reservation is known to have gone back
+// to the OS, or was never touched, and nothing was carved over it since
+static uint64_t *trim_map = NULL;
+
+static size_t page_round(size_t size) {
+  return (size + page_size - 1) & ~(page_size - 1);
+}
+
+// metadata is mapped straight from the OS, going through malloc would make
+// the allocator depend on another allocator
+static void *page_alloc(size_t size) {
+  void *ptr = mmap(NULL, page_round(size), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static void page_free(void *ptr, size_t size) {
+  if (ptr != NULL)
+    munmap(ptr, page_round(size));
+}
+
+// a single writer needs no read-modify-write, the relaxed load and store
+// compile to plain moves and still keep readers from seeing torn values
+static void counter_add(_Atomic uint64_t *c, uint64_t n) {
+  atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                        memory_order_relaxed);
+}
+
+static size_t log2_bucket(uint64_t n) {
+  const size_t i = 63 - __builtin_clzll(n | 1);
+  return i < HEAP_STATS_BUCKETS ? i : HEAP_STATS_BUCKETS - 1;
+}
+
+#ifdef HEAP_CHUNK_LIST
+
+// large free chunks in an array sorted by address, found by bsearch and
+// shifted into place, first fit scans from the front
+typedef struct {
+  Chunk *chunks;
+  size_t size;
+  size_t cap;
+} ChunkList;
+
+static ChunkList chunks_free = {0};
+
+static int chunk_cmp_less(const void *p1, const void *p2) {
+  const char *s1 = ((Chunk *)p1)->start;
+  const char *s2 = ((Chunk *)p2)->start;
+  return (s1 > s2) - (s1 < s2);
+}
+
+static int chunk_list_find(const ChunkList *list, void *ptr) {
+  Chunk key = {.start = ptr};
+  const Chunk *ret =
+      bsearch(&key, list->chunks, list->size, sizeof(Chunk), chunk_cmp_less);
+
+  if (ret != NULL) {
+    assert(ret >= list->chunks);
+    return ret - list->chunks;
+  } else {
+    return -1;
+  }
+}
+
+static void chunk_list_reserve(ChunkList *list, size_t cap) {
+  if (cap <= list->cap)
+    return;
+
+  cap = page_round(cap * sizeof(Chunk)) / sizeof(Chunk);
+  Chunk *chunks = page_alloc(cap * sizeof(Chunk));
+  if (chunks == NULL) {
+    fprintf(stderr, "Error: chunk list reserve %zu\n", cap);
+    abort();
+  }
+  if (list->chunks != NULL)
+    memcpy(chunks, list->chunks, list->size * sizeof(Chunk));
+  page_free(list->chunks, list->cap * sizeof(Chunk));
+  list->chunks = chunks;
+  list->cap = cap;
+}
+
+static void chunk_list_insert(ChunkList *list, void *ptr, size_t size) {
+  if (list->size == list->cap)
+    chunk_list_reserve(list, list->cap * 2 + 1);
+  list->chunks[list->size].start = ptr;
+  list->chunks[list->size].size = size;
+  for (size_t i = list->size;
+       i > 0 && list->chunks[i].start <= list->chunks[i - 1].start; i--) {
+    const Chunk temp = list->chunks[i];
+    list->chunks[i] = list->chunks[i - 1];
+    list->chunks[i - 1] = temp;
+  }
+  list->size += 1;
+}
+
+static void chunk_list_remove(ChunkList *list, size_t index) {
+  assert(index < list->size);
+  for (size_t i = index; i < list->size - 1; i++) {
+    list->chunks[i] = list->chunks[i + 1];
+  }
+  list->size -= 1;
+}
+
+static void chunks_init(void) {
+  chunk_list_reserve(&chunks_free, page_size / sizeof(Chunk));
+}
+
+static void chunks_insert(void *start, size_t size) {
+  chunk_list_insert(&chunks_free, start, size);
+}
+
+static void chunks_remove(void *start) {
+  const int index = chunk_list_find(&chunks_free, start);
+  assert(index >= 0);
+  chunk_list_remove(&chunks_free, (size_t)index);
+}
+
+static void *chunks_take(size_t size, const void *limit, size_t *taken) {
+  for (size_t i = 0; i < chunks_free.size; i++) {
+    Chunk *c = &chunks_free.chunks[i];
+    if ((const void *)c->start >= limit)
+      break;
+    if (c->size < size)
+      continue;
+
+    void *start = c->start;
+    *taken = c->size;
+    if (c->size - size > SIZE_CLASS_MAX) {
+      c->start = (char *)c->start + size;
+      c->size -= size;
+    } else {
+      chunk_list_remove(&chunks_free, i);
+    }
+    return start;
+  }
+  return NULL;
+}
+
+static void chunks_clear(void) { chunks_free.size = 0; }
+
+typedef size_t ChunkIter;
+
+static ChunkIter chunks_iter(void) { return 0; }
+
+static bool chunks_next(ChunkIter *it, Chunk *c) {
+  if (*it == chunks_free.size)
+    return false;
+  *c = chunks_free.chunks[(*it)++];
+  return true;
+}
+
+#else
+
+// large free chunks in a B+tree ordered by address, a node keeps keys and
+// sizes in separate arrays so a search reads a few cache lines per level,
+// an inner node keeps for every child a lower bound of the keys below it
+// and the largest size below it, so first fit walks straight down to the
+// lowest chunk that is large enough
+typedef struct ChunkNode {
+  uintptr_t keys[CHUNK_FANOUT];
+  size_t sizes[CHUNK_FANOUT];
+  struct ChunkNode *children[CHUNK_FANOUT];
+  struct ChunkNode *next;
+  uint32_t len;
+} ChunkNode;
+
+// `height` counts the inner levels, leaves are chained in address order
+// through next, released nodes wait in `spare`
+typedef struct {
+  ChunkNode *root;
+  size_t height;
+  size_t size;
+  ChunkNode *spare;
+} ChunkTree;
+
+// the nodes passed on the way down to a leaf and the slot taken in each
+typedef struct {
+  ChunkNode *nodes[CHUNK_DEPTH];
+  uint32_t slots[CHUNK_DEPTH];
+} ChunkPath;
+
+static ChunkTree chunks_free = {0};
+
+static ChunkNode *chunk_node_new(void) {
+  ChunkNode *n = chunks_free.spare;
+  if (n == NULL) {
+    const size_t count = page_round(sizeof(ChunkNode)) / sizeof(ChunkNode);
+    n = page_alloc(count * sizeof(ChunkNode));
+    if (n == NULL) {
+      fprintf(stderr, "Error: chunk node alloc %zu\n", count);
+      abort();
+    }
+    for (size_t i = 1; i < count; i++) {
+      n[i].next = chunks_free.spare;
+      chunks_free.spare = &n[i];
+    }
+  } else {
+    chunks_free.spare = n->next;
+  }
+  memset(n, 0, sizeof(ChunkNode));
+  return n;
+}
+
+static void chunk_node_release(ChunkNode *n) {
+  n->next = chunks_free.spare;
+  chunks_free.spare = n;
+}
+
+static size_t chunk_node_max(const ChunkNode *n) {
+  size_t max = 0;
+  for (uint32_t i = 0; i < n->len; i++)
+    max = n->sizes[i] > max ? n->sizes[i] : max;
+  return max;
+}
+
+// the last child whose lower bound is not above `key`
+static uint32_t chunk_node_route(const ChunkNode *n, uintptr_t key) {
+  uint32_t i = 0;
+  while (i + 1 < n->len && n->keys[i + 1] <= key)
+    i++;
+  return i;
+}
+
+// copy `count` slots from src[si] to dst[di], the ranges may overlap
+static void chunk_node_move(ChunkNode *dst, uint32_t di, const ChunkNode *src,
+                            uint32_t si, uint32_t count) {
+  memmove(&dst->keys[di], &src->keys[si], count * sizeof(uintptr_t));
+  memmove(&dst->sizes[di], &src->sizes[si], count * sizeof(size_t));
+  memmove(&dst->children[di], &src->children[si], count * sizeof(ChunkNode *));
+}
+
+static void chunk_node_insert(ChunkNode *n, uint32_t i, uintptr_t key,
+                              size_t size, ChunkNode *child) {
+  chunk_node_move(n, i + 1, n, i, n->len - i);
+  n->keys[i] = key;
+  n->sizes[i] = size;
+  n->children[i] = child;
+  n->len += 1;
+}
+
+static void chunk_node_erase(ChunkNode *n, uint32_t i) {
+  chunk_node_move(n, i, n, i + 1, n->len - i - 1);
+  n->len -= 1;
+}
+
+// the upper half of a full node moves into a new right sibling
+static ChunkNode *chunk_node_split(ChunkNode *n) {
+  ChunkNode *m = chunk_node_new();
+  const uint32_t half = n->len / 2;
+  m->len = n->len - half;
+  chunk_node_move(m, 0, n, half, m->len);
+  n->len = half;
+  m->next = n->next;
+  n->next = m;
+  return m;
+}
+
+// walk back up after a removal or a shrink, the largest sizes on the path
+// are refreshed and a node that fell below a quarter is merged with a
+// sibling, or evens out with it when both do not fit into one node
+static void chunk_tree_fix(ChunkPath *path, ChunkNode *n) {
+  ChunkTree *t = &chunks_free;
+  for (size_t d = t->height; d > 0; d--) {
+    ChunkNode *p = path->nodes[d - 1];
+    const uint32_t s = path->slots[d - 1];
+    if (n->len >= CHUNK_FANOUT / 4) {
+      p->sizes[s] = chunk_node_max(n);
+      n = p;
+      continue;
+    }
+
+    // the first key of an inner node is only a lower bound, possibly left
+    // behind by a raised separator, the separator itself is the tighter one
+    const uint32_t l = s > 0 ? s - 1 : s;
+    ChunkNode *a = p->children[l];
+    ChunkNode *b = p->children[l + 1];
+    const uint32_t total = a->len + b->len;
+    if (d < t->height)
+      b->keys[0] = p->keys[l + 1];
+    if (total < CHUNK_FANOUT) {
+      chunk_node_move(a, a->len, b, 0, b->len);
+      a->len = total;
+      a->next = b->next;
+      chunk_node_release(b);
+      chunk_node_erase(p, l + 1);
+    } else if (a->len < total / 2) {
+      const uint32_t k = total / 2 - a->len;
+      chunk_node_move(a, a->len, b, 0, k);
+      chunk_node_move(b, 0, b, k, b->len - k);
+      a->len += k;
+      b->len -= k;
+    } else {
+      const uint32_t k = a->len - total / 2;
+      chunk_node_move(b, k, b, 0, b->len);
+      chunk_node_move(b, 0, a, a->len - k, k);
+      a->len -= k;
+      b->len += k;
+    }
+    p->sizes[l] = chunk_node_max(a);
+    if (total >= CHUNK_FANOUT) {
+      p->keys[l + 1] = b->keys[0];
+      p->sizes[l + 1] = chunk_node_max(b);
+    }
+    n = p;
+  }
+
+  if (t->height > 0 && n->len == 1) {
+    t->root = n->children[0];
+    t->height -= 1;
+    chunk_node_release(n);
+  } else if (t->height == 0 && n->len == 0) {
+    t->root = NULL;
+    chunk_node_release(n);
+  }
+}
+
+static void chunks_init(void) { chunk_node_release(chunk_node_new()); }
+
+static void chunks_insert(void *start, size_t size) {
+  ChunkTree *t = &chunks_free;
+  const uintptr_t key = (uintptr_t)start;
+  if (t->root == NULL)
+    t->root = chunk_node_new();
+
+  ChunkPath path;
+  ChunkNode *n = t->root;
+  for (size_t d = 0; d < t->height; d++) {
+    const uint32_t i = chunk_node_route(n, key);
+    if (key < n->keys[i])
+      n->keys[i] = key;
+    if (size > n->sizes[i])
+      n->sizes[i] = size;
+    path.nodes[d] = n;
+    path.slots[d] = i;
+    n = n->children[i];
+  }
+  uint32_t i = 0;
+  while (i < n->len && n->keys[i] < key)
+    i++;
+  chunk_node_insert(n, i, key, size, NULL);
+  t->size += 1;
+
+  // nodes never stay full, the upper half of one that did goes next to it
+  // in the parent
+  for (size_t d = t->height; n->len == CHUNK_FANOUT; d--) {
+    ChunkNode *m = chunk_node_split(n);
+    if (d == 0) {
+      assert(t->height + 1 < CHUNK_DEPTH);
+      ChunkNode *root = chunk_node_new();
+      chunk_node_insert(root, 0, n->keys[0], chunk_node_max(n), n);
+      chunk_node_insert(root, 1, m->keys[0], chunk_node_max(m), m);
+      t->root = root;
+      t->height += 1;
+      return;
+    }
+    ChunkNode *p = path.nodes[d - 1];
+    const uint32_t s = path.slots[d - 1];
+    p->sizes[s] = chunk_node_max(n);
+    chunk_node_insert(p, s + 1, m->keys[0], chunk_node_max(m), m);
+    n = p;
+  }
+}
+
+static void chunks_remove(void *start) {
+  ChunkTree *t = &chunks_free;
+  const uintptr_t key = (uintptr_t)start;
+  ChunkPath path;
+  ChunkNode *n = t->root;
+  for (size_t d = 0; d < t->height; d++) {
+    path.nodes[d] = n;
+    path.slots[d] = chunk_node_route(n, key);
+    n = n->children[path.slots[d]];
+  }
+  uint32_t i = 0;
+  while (i < n->len && n->keys[i] < key)
+    i++;
+  assert(i < n->len && n->keys[i] == key);
+  chunk_node_erase(n, i);
+  t->size -= 1;
+  chunk_tree_fix(&path, n);
+}
+
+// the lowest chunk of at least `size` bytes starting below `limit`, a tail
+// larger than SIZE_CLASS_MAX keeps the slot, its key only moves up within
+// the chunk so the order holds, a separator it passes is raised to the end
+// of the chunk which no other key can lie below
+static void *chunks_take(size_t size, const void *limit, size_t *taken) {
+  ChunkTree *t = &chunks_free;
+  if (t->root == NULL)
+    return NULL;
+
+  ChunkPath path;
+  ChunkNode *n = t->root;
+  for (size_t d = 0;; d++) {
+    uint32_t i = 0;
+    while (i < n->len && n->sizes[i] < size)
+      i++;
+    if (i == n->len)
+      return NULL;
+    if (d == t->height) {
+      if (n->keys[i] >= (uintptr_t)limit)
+        return NULL;
+      path.slots[d] = i;
+      break;
+    }
+    path.nodes[d] = n;
+    path.slots[d] = i;
+    n = n->children[i];
+  }
+
+  const uint32_t i = path.slots[t->height];
+  void *start = (void *)n->keys[i];
+  *taken = n->sizes[i];
+  if (*taken - size > SIZE_CLASS_MAX) {
+    n->keys[i] += size;
+    n->sizes[i] -= size;
+    for (size_t d = t->height; i + 1 == n->len && d > 0; d--) {
+      ChunkNode *p = path.nodes[d - 1];
+      const uint32_t s = path.slots[d - 1];
+      if (s + 1 < p->len) {
+        if (p->keys[s + 1] <= n->keys[i])
+          p->keys[s + 1] = n->keys[i] + n->sizes[i];
+        break;
+      }
+    }
+  } else {
+    chunk_node_erase(n, i);
+    t->size -= 1;
+  }
+  chunk_tree_fix(&path, n);
+  return start;
+}
+
+static void chunk_node_clear(ChunkNode *n, size_t height) {
+  for (uint32_t i = 0; height > 0 && i < n->len; i++)
+    chunk_node_clear(n->children[i], height - 1);
+  chunk_node_release(n);
+}
+
+static void chunks_clear(void) {
+  if (chunks_free.root != NULL)
+    chunk_node_clear(chunks_free.root, chunks_free.height);
+  chunks_free.root = NULL;
+  chunks_free.height = 0;
+  chunks_free.size = 0;
+}
+
+typedef struct {
+  const ChunkNode *leaf;
+  uint32_t i;
+} ChunkIter;
+
+static ChunkIter chunks_iter(void) {
+  const ChunkNode *n = chunks_free.root;
+  for (size_t d = 0; d < chunks_free.height; d++)
+    n = n->children[0];
+  return (ChunkIter){n, 0};
+}
+
+static bool chunks_next(ChunkIter *it, Chunk *c) {
+  while (it->leaf != NULL && it->i == it->leaf->len) {
+    it->leaf = it->leaf->next;
+    it->i = 0;
+  }
+  if (it->leaf == NULL)
+    return false;
+  *c = (Chunk){(void *)it->leaf->keys[it->i], it->leaf->sizes[it->i]};
+  it->i += 1;
+  return true;
+}
+
+#endif
+
+static void chunks_dump(void) {
+  printf("Chunks(%zu)\n", chunks_free.size);
+  size_t i = 0;
+  Chunk c;
+  for (ChunkIter it = chunks_iter(); chunks_next(&it, &c); i++)
+    printf("  chunk %zu: start: %p, size: %zu\n", i, c.start, c.size);
+}
+
+// relaxed is enough, heap_lock orders everything but the flag flips, and
+// those only need to not lose a concurrent flip of another bit
+static size_t header_get(const FreeBlock *b) {
+  return atomic_load_explicit(&b->header, memory_order_relaxed);
+}
+
+static void header_set(FreeBlock *b, size_t header) {
+  atomic_store_explicit(&b->header, header, memory_order_relaxed);
+}
+
+static void header_or(FreeBlock *b, size_t flags) {
+  atomic_fetch_or_explicit(&b->header, flags, memory_order_relaxed);
+}
+
+static void header_and(FreeBlock *b, size_t mask) {
+  atomic_fetch_and_explicit(&b->header, mask, memory_order_relaxed);
+}
+
+static size_t block_size(const FreeBlock *b) {
+  return header_get(b) & BLOCK_SIZE_MASK;
+}
+
+static bool block_inuse(const FreeBlock *b) {
+  return header_get(b) & BLOCK_INUSE;
+}
+
+static FreeBlock *block_next(const FreeBlock *b) {
+  return (FreeBlock *)((char *)b + block_size(b));
+}
+
+// only valid while the previous block is free, its footer sits right in
+// front of our header
+static FreeBlock *block_prev(const FreeBlock *b) {
+  assert(!(header_get(b) & BLOCK_PREV_INUSE));
+  const size_t size = *((const size_t *)b - 1);
+  return (FreeBlock *)((char *)b - size);
+}
+
+static void *block_payload(FreeBlock *b) { return (char *)b + BLOCK_HEADER; }
+
+static FreeBlock *payload_block(void *ptr) {
+  return (FreeBlock *)((char *)ptr - BLOCK_HEADER);
+}
+
+// size of a block able to hold `size` bytes of payload
+static size_t block_request(size_t size) {
+  size = (size + BLOCK_HEADER + SIZE_CLASS_STEP - 1) & ~(SIZE_CLASS_STEP - 1);
+  return size < BLOCK_MIN ? BLOCK_MIN : size;
+}
+
+static bool trim_map_get(size_t p) {
+  return trim_map[p / 64] >> (p % 64) & 1;
+}
+
+static void trim_map_set(size_t lo, size_t hi) {
+  for (size_t p = lo; p < hi; p++)
+    trim_map[p / 64] |= 1ull << (p % 64);
+}
+
+// the pages overlapping [start, start + size) are about to be written
+static void trim_map_clear(const void *start, size_t size) {
+  const size_t lo = ((const char *)start - heap) / page_size;
+  const size_t hi = ((const char *)start - heap + size - 1) / page_size;
+  for (size_t p = lo; p <= hi; p++)
+    trim_map[p / 64] &= ~(1ull << (p % 64));
+}
+
+static void block_set_free(FreeBlock *b, size_t size) {
+  trim_map_clear(b, BLOCK_HEADER);
+  trim_map_clear((char *)b + size - sizeof(size_t), sizeof(size_t));
+  header_set(b, size | (header_get(b) & BLOCK_PREV_INUSE));
+  *(size_t *)((char *)b + size - sizeof(size_t)) = size;
+  header_and(block_next(b), ~BLOCK_PREV_INUSE);
+}
+
+static void block_set_inuse(FreeBlock *b, size_t size) {
+  trim_map_clear(b, size);
+  header_set(b, size | (header_get(b) & BLOCK_PREV_INUSE) | BLOCK_INUSE);
+  header_or(block_next(b), BLOCK_PREV_INUSE);
+}
+
+static size_t size_class(size_t size) { return (size - 1) / SIZE_CLASS_STEP; }
+
+static size_t class_size(size_t c) { return (c + 1) * SIZE_CLASS_STEP; }
+
+static void bin_push(FreeBlock *b) {
+  const size_t c = size_class(block_size(b));
+  assert(c < NUM_SIZE_CLASS);
+  b->prev = NULL;
+  b->next = bins[c];
+  if (b->next != NULL)
+    b->next->prev = b;
+  bins[c] = b;
+  bins_bitmap |= 1ull << c;
+}
+
+static void bin_unlink(FreeBlock *b) {
+  const size_t c = size_class(block_size(b));
+  assert(c < NUM_SIZE_CLASS);
+  if (b->prev != NULL) {
+    b->prev->next = b->next;
+  } else {
+    bins[c] = b->next;
+  }
+  if (b->next != NULL)
+    b->next->prev = b->prev;
+  if (bins[c] == NULL)
+    bins_bitmap &= ~(1ull << c);
+}
+
+// unlink the head of the smallest non-empty bin that fits `size`, the caller
+// gives the tail of a bigger block back
+static FreeBlock *bin_alloc(size_t size) {
+  const uint64_t mask = bins_bitmap & (~0ull << size_class(size));
+  if (mask == 0)
+    return NULL;
+
+  FreeBlock *b = bins[__builtin_ctzll(mask)];
+  bin_unlink(b);
+  return b;
+}
+
+static void bin_dump(void) {
+  printf("Bins(0x%016llx)\n", (unsigned long long)bins_bitmap);
+  for (size_t c = 0; c < NUM_SIZE_CLASS; c++) {
+    size_t n = 0;
+    for (FreeBlock *b = bins[c]; b != NULL; b = b->next)
+      n++;
+    if (n > 0)
+      printf("  bin %zu: size: %zu, blocks: %zu\n", c, class_size(c), n);
+  }
+}
+
+static void free_insert(FreeBlock *b) {
+  if (block_size(b) <= SIZE_CLASS_MAX) {
+    bin_push(b);
+  } else {
+    chunks_insert(b, block_size(b));
+  }
+}
+
+static void free_remove(FreeBlock *b) {
+  if (block_size(b) <= SIZE_CLASS_MAX) {
+    bin_unlink(b);
+  } else {
+    chunks_remove(b);
+  }
+}
+
+// first fit over the large free blocks starting below `limit`, a large
+// enough tail stays a free chunk in place
+static FreeBlock *chunks_alloc(size_t size, const void *limit) {
+  size_t taken;
+  FreeBlock *b = chunks_take(size, limit, &taken);
+  if (b != NULL && taken - size > SIZE_CLASS_MAX) {
+    FreeBlock *rest = (FreeBlock *)((char *)b + size);
+    header_set(rest, BLOCK_PREV_INUSE);
+    block_set_free(rest, taken - size);
+    header_set(b, size | (header_get(b) & BLOCK_PREV_INUSE));
+  }
+  return b;
+}
+
+// the header gives the size and the right neighbour, the footer of a free
+// left neighbour gives that one, so both merges happen right away
+static FreeBlock *block_free(FreeBlock *b) {
+  assert(block_inuse(b));
+  const size_t freed = block_size(b);
+  size_t size = freed;
+
+  FreeBlock *next = block_next(b);
+  if (!block_inuse(next)) {
+    free_remove(next);
+    size += block_size(next);
+    merges += 1;
+  }
+  if (!(header_get(b) & BLOCK_PREV_INUSE)) {
+    FreeBlock *prev = block_prev(b);
+    free_remove(prev);
+    size += block_size(prev);
+    b = prev;
+    merges += 1;
+  }
+  block_set_free(b, size);
+  free_insert(b);
+  if (size > SIZE_CLASS_MAX) {
+    trim_pending += freed;
+    if (trim_running && trim_pending >= HEAP_TRIM_THRESHOLD)
+      pthread_cond_signal(&trim_cond);
+  }
+  return b;
+}
+
+// the first header sits one word into the heap so that every payload lands
+// on a SIZE_CLASS_STEP boundary, the end marker takes the last word
+static FreeBlock *heap_first(void) {
+  return (FreeBlock *)(heap + BLOCK_HEADER);
+}
+
+static FreeBlock *heap_end(void) {
+  return (FreeBlock *)(heap + heap_size - BLOCK_HEADER);
+}
+
+// make `size` more bytes of the reservation usable, the old end marker turns
+// into a free block spanning the new segment and merges with its left
+// neighbour if that one is free
+static bool heap_grow(size_t size) {
+  size = page_round(size < heap_grow_min ? heap_grow_min : size);
+  if (size > HEAP_RESERVE - heap_size)
+    return false;
+  if (mprotect(heap + heap_size, size, PROT_READ | PROT_WRITE) != 0)
+    return false;
+
+  FreeBlock *b = heap_end();
+  heap_size += size;
+  FreeBlock *end = heap_end();
+  header_set(end, BLOCK_INUSE);
+  header_set(b, size | (header_get(b) & BLOCK_PREV_INUSE) | BLOCK_INUSE);
+  block_free(b);
+  // fresh pages are not resident yet, there is nothing to trim, only the
+  // last one holds the footer and end marker
+  trim_pending -= size;
+  trim_map_set((heap_size - size) / page_size, heap_size / page_size - 1);
+  return true;
+}
+
+// a child forked while another thread held heap_lock or trace_lock would
+// never see it released
+static void heap_prefork(void) {
+  pthread_mutex_lock(&heap_lock);
+  pthread_mutex_lock(&trace_lock);
+}
+
+static void heap_postfork(void) {
+  pthread_mutex_unlock(&trace_lock);
+  pthread_mutex_unlock(&heap_lock);
+}
+
+// the child shares the trace file with its parent, which still flushes the
+// buffered events itself, so the child drops them and stops tracing rather
+// than interleave its own calls into the same file
+static void heap_postfork_child(void) {
+  if (trace_fd >= 0) {
+    close(trace_fd);
+    trace_fd = -1;
+    trace_len = 0;
+  }
+  heap_postfork();
+}
+
+// reserve the address space and make the first segment usable, it starts
+// out as one free block terminated by an in-use header of size 0 that stops
+// coalescing at the end
+static void heap_init(void) {
+  page_size = sysconf(_SC_PAGESIZE);
+  void *ptr = mmap(NULL, HEAP_RESERVE, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ptr == MAP_FAILED)
+    return;
+  const size_t size = page_round(HEAP_GROW_MIN);
+  trim_map = page_alloc(HEAP_RESERVE / page_size / 8);
+  if (trim_map == NULL || mprotect(ptr, size, PROT_READ | PROT_WRITE) != 0) {
+    munmap(ptr, HEAP_RESERVE);
+    return;
+  }
+  chunks_init();
+  owners = page_alloc(MAX_OWNERS * sizeof(TCache *));
+  pthread_key_create(&tcache_key, tcache_destroy);
+  pthread_atfork(heap_prefork, heap_postfork, heap_postfork_child);
+
+  heap = ptr;
+  heap_size = size;
+  FreeBlock *b = heap_first();
+  FreeBlock *end = heap_end();
+  header_set(end, BLOCK_INUSE);
+  header_set(b, BLOCK_PREV_INUSE);
+  block_set_free(b, heap_size - 2 * BLOCK_HEADER);
+  free_insert(b);
+  trim_map_set(1, heap_size / page_size - 1);
+}
+
+// mark a block just taken out of the free structures in use and give back
+// whatever it has beyond `size`
+static void block_carve(FreeBlock *b, size_t size) {
+  const size_t rest = block_size(b) - size;
+  if (rest >= BLOCK_MIN) {
+    FreeBlock *r = (FreeBlock *)((char *)b + size);
+    header_set(r, BLOCK_PREV_INUSE);
+    block_set_free(r, rest);
+    free_insert(r);
+  } else {
+    size = block_size(b);
+  }
+  block_set_inuse(b, size);
+}
+
+// caches of exited threads are only taken off the idle list under heap_lock,
+// whatever was sent to them after their drain goes straight back to the heap
+// on the next central allocation
+static void remote_reclaim(void) {
+  for (TCache *tc = tcaches_idle; tc != NULL; tc = tc->idle) {
+    if (atomic_load_explicit(&tc->remote, memory_order_relaxed) == NULL)
+      continue;
+    FreeBlock *b =
+        atomic_exchange_explicit(&tc->remote, NULL, memory_order_acquire);
+    while (b != NULL) {
+      FreeBlock *next = b->next;
+      block_free(b);
+      b = next;
+    }
+  }
+}
+
+// take a block of at least `size` bytes out of the free structures and give
+// back whatever is left over, heap_lock must be held
+static FreeBlock *central_alloc(size_t size) {
+  remote_reclaim();
+  FreeBlock *b = NULL;
+  if (size <= SIZE_CLASS_MAX)
+    b = bin_alloc(size);
+  if (b == NULL)
+    b = chunks_alloc(size, heap_end());
+  if (b == NULL) {
+    if (!heap_grow(size))
+      return NULL;
+    b = chunks_alloc(size, heap_end());
+    assert(b != NULL);
+  }
+  block_carve(b, size);
+  return b;
+}
+
+// give the tail of an in-use block beyond `size` back if it can stand on
+// its own, heap_lock must be held
+static void block_shrink(FreeBlock *b, size_t size) {
+  const size_t rest = block_size(b) - size;
+  if (rest < BLOCK_MIN)
+    return;
+
+  FreeBlock *r = (FreeBlock *)((char *)b + size);
+  header_set(r, rest | BLOCK_PREV_INUSE | BLOCK_INUSE);
+  header_set(b, size | (header_get(b) & BLOCK_FLAGS));
+  block_free(r);
+}
+
+// over-allocate by `align` plus room for a leading free block, then cut the
+// block at the first aligned payload and give both ends back, heap_lock must
+// be held
+static FreeBlock *central_alloc_aligned(size_t size, size_t align) {
+  FreeBlock *b = central_alloc(size + align + BLOCK_MIN);
+  if (b == NULL)
+    return NULL;
+
+  const uintptr_t p = (uintptr_t)block_payload(b);
+  uintptr_t q = (p + align - 1) & ~(align - 1);
+  while (q != p && q - p < BLOCK_MIN)
+    q += align;
+  if (q != p) {
+    FreeBlock *a = payload_block((void *)q);
+    const size_t lead = q - p;
+    header_set(a, (block_size(b) - lead) | BLOCK_PREV_INUSE | BLOCK_INUSE);
+    header_set(b, lead | (header_get(b) & BLOCK_FLAGS));
+    block_free(b);
+    b = a;
+  }
+  block_shrink(b, size);
+  return b;
+}
+
+static FreeBlock *mapping_block(Mapping *m) {
+  return (FreeBlock *)&m->header;
+}
+
+static Mapping *block_mapping(FreeBlock *b) {
+  return (Mapping *)((char *)b - offsetof(Mapping, header));
+}
+
+// bytes between the start of the mapping and `m`, zero unless it is aligned
+static size_t mapping_lead(Mapping *m) {
+  return (uintptr_t)m & (page_size - 1);
+}
+
+// heap_lock must be held
+static void mapping_link(Mapping *m) {
+  m->prev = NULL;
+  m->next = mappings;
+  if (mappings != NULL)
+    mappings->prev = m;
+  mappings = m;
+  mappings_size += m->len;
+}
+
+static void mapping_unlink(Mapping *m) {
+  if (m->prev != NULL) {
+    m->prev->next = m->next;
+  } else {
+    mappings = m->next;
+  }
+  if (m->next != NULL)
+    m->next->prev = m->prev;
+  mappings_size -= m->len;
+}
+
+// the block spans everything from its header to the end of the mapping
+static void mapping_set(Mapping *m, size_t len) {
+  m->len = len;
+  FreeBlock *b = mapping_block(m);
+  header_set(b, (len - offsetof(Mapping, header)) | BLOCK_INUSE |
+                    BLOCK_MMAPPED | (header_get(b) & BLOCK_SAMPLED));
+}
+
+// the system calls stay outside heap_lock, only the list is shared
+static FreeBlock *mapping_alloc(size_t size) {
+  const size_t len = page_round(size + offsetof(Mapping, header));
+  Mapping *m = page_alloc(len);
+  if (m == NULL)
+    return NULL;
+  header_set(mapping_block(m), 0);
+  mapping_set(m, len);
+  pthread_mutex_lock(&heap_lock);
+  mapping_link(m);
+  pthread_mutex_unlock(&heap_lock);
+  return mapping_block(m);
+}
+
+// map `align` bytes more than needed, then unmap the pages in front of the
+// first aligned payload and those behind the block
+static FreeBlock *mapping_alloc_aligned(size_t size, size_t align) {
+  const size_t span = page_round(size + offsetof(Mapping, header) + align);
+  char *base = page_alloc(span);
+  if (base == NULL)
+    return NULL;
+
+  const uintptr_t q =
+      ((uintptr_t)base + sizeof(Mapping) + align - 1) & ~(align - 1);
+  Mapping *m = block_mapping(payload_block((void *)q));
+  char *start = (char *)m - mapping_lead(m);
+  char *end = (char *)page_round((uintptr_t)mapping_block(m) + size);
+  if (start != base)
+    munmap(base, start - base);
+  if (end != base + span)
+    munmap(end, base + span - end);
+  header_set(mapping_block(m), 0);
+  mapping_set(m, end - (char *)m);
+  pthread_mutex_lock(&heap_lock);
+  mapping_link(m);
+  pthread_mutex_unlock(&heap_lock);
+  return mapping_block(m);
+}
+
+static void mapping_free(FreeBlock *b) {
+  Mapping *m = block_mapping(b);
+  pthread_mutex_lock(&heap_lock);
+  mapping_unlink(m);
+  pthread_mutex_unlock(&heap_lock);
+  munmap((char *)m - mapping_lead(m), mapping_lead(m) + m->len);
+}
+
+// mremap may move the mapping, so it leaves the list meanwhile, the lead in
+// front of an aligned block moves along but the alignment is not kept
+static FreeBlock *mapping_resize(FreeBlock *b, size_t size) {
+  Mapping *m = block_mapping(b);
+  const size_t lead = mapping_lead(m);
+  const size_t len = page_round(lead + size + offsetof(Mapping, header)) - lead;
+  if (len == m->len)
+    return b;
+
+  pthread_mutex_lock(&heap_lock);
+  mapping_unlink(m);
+  pthread_mutex_unlock(&heap_lock);
+  char *base =
+      mremap((char *)m - lead, lead + m->len, lead + len, MREMAP_MAYMOVE);
+  const bool ok = base != MAP_FAILED;
+  Mapping *n = m;
+  if (ok) {
+    n = (Mapping *)(base + lead);
+    mapping_set(n, len);
+  }
+  pthread_mutex_lock(&heap_lock);
+  mapping_link(n);
+  pthread_mutex_unlock(&heap_lock);
+  return ok ? mapping_block(n) : NULL;
+}
+
+static void tcache_push(TCache *tc, FreeBlock *b, size_t c) {
+  b->next = tc->bins[c];
+  tc->bins[c] = b;
+  tc->counts[c] += 1;
+  counter_add(&tc->stats.bytes_cached, class_size(c));
+}
+
+// blocks that ended up too big for any class go straight back
+static void tcache_put(TCache *tc, FreeBlock *b) {
+  if (block_size(b) <= SIZE_CLASS_MAX) {
+    tcache_push(tc, b, size_class(block_size(b)));
+  } else {
+    pthread_mutex_lock(&heap_lock);
+    block_free(b);
+    pthread_mutex_unlock(&heap_lock);
+  }
+}
+
+static FreeBlock *tcache_pop(TCache *tc, size_t c) {
+  FreeBlock *b = tc->bins[c];
+  if (b != NULL) {
+    tc->bins[c] = b->next;
+    tc->counts[c] -= 1;
+    counter_add(&tc->stats.bytes_cached, -class_size(c));
+  }
+  return b;
+}
+
+// cut an in-use run into `n` blocks of `size` bytes, the last one keeps
+// whatever slack the run came with, headers are only ever written under
+// heap_lock since freeing a neighbour touches them too
+static void run_split(FreeBlock *run, size_t size, size_t n, FreeBlock **out,
+                      uint32_t owner) {
+  char *end = (char *)block_next(run);
+  FreeBlock *b = run;
+  for (size_t i = 0; i < n; i++) {
+    const size_t bsize = i + 1 < n ? size : (size_t)(end - (char *)b);
+    header_set(b, bsize | (header_get(b) & BLOCK_PREV_INUSE) | BLOCK_INUSE |
+                (size_t)owner << BLOCK_OWNER_SHIFT);
+    out[i] = b;
+    b = block_next(b);
+    if (i + 1 < n)
+      header_set(b, BLOCK_PREV_INUSE);
+  }
+}
+
+// the only synchronisation a cross-thread free needs, the owner's bins and
+// counters stay untouched
+static void remote_flush(TCache *tc) {
+  if (tc->pending == NULL)
+    return;
+  TCache *owner = owners[tc->pending_owner];
+  FreeBlock *head = atomic_load_explicit(&owner->remote, memory_order_relaxed);
+  do {
+    tc->pending_tail->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(&owner->remote, &head,
+                                                  tc->pending,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+  tc->pending = NULL;
+  tc->pending_count = 0;
+}
+
+// carve one run of TCACHE_BATCH blocks out of the central heap, hand out
+// the first and cache the rest
+static FreeBlock *tcache_refill(TCache *tc, size_t size) {
+  remote_flush(tc);
+  pthread_mutex_lock(&heap_lock);
+  FreeBlock *run = central_alloc(size * TCACHE_BATCH);
+  if (run == NULL) {
+    FreeBlock *b = central_alloc(size);
+    pthread_mutex_unlock(&heap_lock);
+    return b;
+  }
+
+  FreeBlock *blocks[TCACHE_BATCH];
+  run_split(run, size, TCACHE_BATCH, blocks, tc->id);
+  pthread_mutex_unlock(&heap_lock);
+
+  for (size_t i = 1; i < TCACHE_BATCH; i++)
+    tcache_put(tc, blocks[i]);
+  return run;
+}
+
+// keep the `keep` most recently freed blocks of a cache bin and give the
+// colder rest back to the central heap under a single lock
+static void tcache_flush(TCache *tc, size_t c, size_t keep) {
+  if (tc->counts[c] <= keep)
+    return;
+
+  FreeBlock **tail = &tc->bins[c];
+  for (size_t i = 0; i < keep; i++)
+    tail = &(*tail)->next;
+  FreeBlock *b = *tail;
+  *tail = NULL;
+  counter_add(&tc->stats.bytes_cached,
+              -(uint64_t)((tc->counts[c] - keep) * class_size(c)));
+  tc->counts[c] = keep;
+
+  remote_flush(tc);
+  pthread_mutex_lock(&heap_lock);
+  while (b != NULL) {
+    FreeBlock *next = b->next;
+    block_free(b);
+    b = next;
+  }
+  pthread_mutex_unlock(&heap_lock);
+}
+
+static uint32_t block_owner(const FreeBlock *b) {
+  return header_get(b) >> BLOCK_OWNER_SHIFT;
+}
+
+// producer and consumer pipelines free long runs for the same owner, those
+// go out TCACHE_BATCH blocks at a time, a shorter chain goes out as soon as
+// this thread takes heap_lock for anything
+static void remote_free(TCache *tc, uint32_t owner, FreeBlock *b) {
+  if (tc->pending != NULL && tc->pending_owner != owner)
+    remote_flush(tc);
+  if (tc->pending == NULL)
+    tc->pending_tail = b;
+  b->next = tc->pending;
+  tc->pending = b;
+  tc->pending_owner = owner;
+  if (++tc->pending_count == TCACHE_BATCH)
+    remote_flush(tc);
+}
+
+// take everything other threads gave back in one exchange, bins that ran
+// over are trimmed once at the end as after a local free
+static void tcache_drain(TCache *tc) {
+  FreeBlock *b =
+      atomic_exchange_explicit(&tc->remote, NULL, memory_order_acquire);
+  uint64_t touched = 0;
+  while (b != NULL) {
+    FreeBlock *next = b->next;
+    const size_t c = size_class(block_size(b));
+    tcache_push(tc, b, c);
+    touched |= 1ull << c;
+    b = next;
+  }
+  for (; touched != 0; touched &= touched - 1) {
+    const size_t c = __builtin_ctzll(touched);
+    if (tc->counts[c] > TCACHE_LIMIT)
+      tcache_flush(tc, c, TCACHE_LIMIT - TCACHE_BATCH);
+  }
+}
+
+static void counters_merge(Counters *dst, Counters *src) {
+  for (size_t op = 0; op < NUM_STATS_OP; op++) {
+    counter_add(&dst->calls[op], src->calls[op]);
+    for (size_t i = 0; i < HEAP_STATS_BUCKETS; i++)
+      counter_add(&dst->latency[op][i], src->latency[op][i]);
+  }
+  counter_add(&dst->bytes_cached, src->bytes_cached);
+}
+
+// the counters move to `retired` so a reused cache starts from zero, remote
+// frees arriving after the drain wait for the next thread to take the cache
+static void tcache_destroy(void *arg) {
+  TCache *tc = arg;
+  remote_flush(tc);
+  tcache_drain(tc);
+  for (size_t c = 0; c < NUM_SIZE_CLASS; c++)
+    tcache_flush(tc, c, 0);
+  pthread_mutex_lock(&heap_lock);
+  counters_merge(&retired, &tc->stats);
+  Counters *stats = &tc->stats;
+  for (size_t op = 0; op < NUM_STATS_OP; op++) {
+    atomic_store_explicit(&stats->calls[op], 0, memory_order_relaxed);
+    for (size_t i = 0; i < HEAP_STATS_BUCKETS; i++)
+      atomic_store_explicit(&stats->latency[op][i], 0, memory_order_relaxed);
+  }
+  tc->idle = tcaches_idle;
+  tcaches_idle = tc;
+  tcaches_live -= 1;
+  pthread_mutex_unlock(&heap_lock);
+  tcache = NULL;
+}
+
+// caches past MAX_OWNERS get id 0 and simply never receive remote frees
+static TCache *tcache_get(void) {
+  if (tcache != NULL)
+    return tcache;
+
+  pthread_once(&heap_once, heap_init);
+  if (heap == NULL || owners == NULL)
+    return NULL;
+  pthread_mutex_lock(&heap_lock);
+  TCache *tc = tcaches_idle;
+  if (tc != NULL)
+    tcaches_idle = tc->idle;
+  tcaches_live += tc != NULL;
+  pthread_mutex_unlock(&heap_lock);
+
+  if (tc == NULL) {
+    tc = page_alloc(sizeof(TCache));
+    if (tc == NULL)
+      return NULL;
+    pthread_mutex_lock(&heap_lock);
+    if (owners_len < MAX_OWNERS) {
+      tc->id = owners_len++;
+      owners[tc->id] = tc;
+    }
+    tc->next = tcaches;
+    tcaches = tc;
+    tcaches_live += 1;
+    pthread_mutex_unlock(&heap_lock);
+  }
+  tcache = tc;
+  pthread_setspecific(tcache_key, tc);
+  return tc;
+}
+
+static uint64_t clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// trace_lock must be held
+static void trace_flush(void) {
+  const char *p = (const char *)trace_buf;
+  size_t n = trace_len * sizeof(HeapTraceEvent);
+  while (n > 0) {
+    const ssize_t w = write(trace_fd, p, n);
+    if (w <= 0)
+      break;
+    p += w;
+    n -= w;
+  }
+  trace_len = 0;
+}
+
+static void trace_event(int op, void *ptr, void *old, size_t size) {
+  if (atomic_load_explicit(&trace_fd, memory_order_relaxed) < 0)
+    return;
+
+  pthread_mutex_lock(&trace_lock);
+  if (trace_fd >= 0) {
+    trace_buf[trace_len++] = (HeapTraceEvent){
+        .ts = clock_ns() - trace_start,
+        .ptr = (uintptr_t)ptr,
+        .old = (uintptr_t)old,
+        .size_op = (uint64_t)size << 8 | op,
+    };
+    if (trace_len == TRACE_BUF_LEN)
+      trace_flush();
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+bool heap_trace_start(const char *path) {
+  pthread_once(&heap_once, heap_init);
+  pthread_mutex_lock(&trace_lock);
+  if (trace_fd >= 0) {
+    pthread_mutex_unlock(&trace_lock);
+    return false;
+  }
+  if (trace_buf == NULL)
+    trace_buf = page_alloc(TRACE_BUF_LEN * sizeof(HeapTraceEvent));
+  const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace_buf == NULL || fd < 0 ||
+      write(fd, HEAP_TRACE_MAGIC, 8) != 8) {
+    if (fd >= 0)
+      close(fd);
+    pthread_mutex_unlock(&trace_lock);
+    return false;
+  }
+  trace_len = 0;
+  trace_start = clock_ns();
+  trace_fd = fd;
+  pthread_mutex_unlock(&trace_lock);
+  return true;
+}
+
+void heap_trace_stop(void) {
+  pthread_mutex_lock(&trace_lock);
+  if (trace_fd >= 0) {
+    trace_flush();
+    close(trace_fd);
+    trace_fd = -1;
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+static size_t profile_find(uintptr_t ptr) {
+  size_t i = (ptr >> 4) * 0x9e3779b97f4a7c15ull >> (64 - PROFILE_BITS);
+  while (profile[i].ptr != 0 && profile[i].ptr != ptr)
+    i = (i + 1) & (PROFILE_SLOTS - 1);
+  return i;
+}
+
+// backward shift keeps probe chains intact without tombstones, profile_lock
+// must be held
+static void profile_remove(uintptr_t ptr) {
+  size_t i = profile_find(ptr);
+  if (profile[i].ptr == 0)
+    return;
+  profile_len -= 1;
+  for (size_t j = i;;) {
+    profile[i].ptr = 0;
+    for (;;) {
+      j = (j + 1) & (PROFILE_SLOTS - 1);
+      if (profile[j].ptr == 0)
+        return;
+      const size_t home =
+          (profile[j].ptr >> 4) * 0x9e3779b97f4a7c15ull >> (64 - PROFILE_BITS);
+      if (((j - home) & (PROFILE_SLOTS - 1)) >= ((j - i) & (PROFILE_SLOTS - 1)))
+        break;
+    }
+    profile[i] = profile[j];
+    i = j;
+  }
+}
+
+// gaps between samples are exponential with mean `rate`, every byte then has
+// the same chance of being sampled however the allocations are sized
+static int64_t profile_interval(TCache *tc, size_t rate) {
+  if (tc->rng == 0)
+    tc->rng = (uintptr_t)tc | 1;
+  tc->rng ^= tc->rng << 13;
+  tc->rng ^= tc->rng >> 7;
+  tc->rng ^= tc->rng << 17;
+  const double u = ((tc->rng >> 11) + 1) * 0x1p-53;
+  return (int64_t)(-log(u) * rate) + 1;
+}
+
+// the first two frames are this function and the public entry point, the
+// header flag is set last and under heap_lock like every header write
+static __attribute__((noinline)) void profile_sample(void *ptr, size_t size,
+                                                     size_t rate) {
+  void *frames[PROFILE_DEPTH + 2];
+  profile_busy = true;
+  const int depth = backtrace(frames, PROFILE_DEPTH + 2) - 2;
+  profile_busy = false;
+  if (depth <= 0)
+    return;
+
+  bool sampled = false;
+  pthread_mutex_lock(&profile_lock);
+  if (profile != NULL && profile_len < PROFILE_SLOTS / 2) {
+    Sample *s = &profile[profile_find((uintptr_t)ptr)];
+    profile_len += s->ptr == 0;
+    *s = (Sample){
+        .ptr = (uintptr_t)ptr,
+        .size = size,
+        .weight = size / (1.0 - exp(-(double)size / rate)),
+        .depth = depth,
+    };
+    memcpy(s->frames, frames + 2, depth * sizeof(void *));
+    sampled = true;
+  }
+  pthread_mutex_unlock(&profile_lock);
+
+  if (sampled) {
+    pthread_mutex_lock(&heap_lock);
+    header_or(payload_block(ptr), BLOCK_SAMPLED);
+    pthread_mutex_unlock(&heap_lock);
+  }
+}
+
+// runs on every allocation, always inlined so the public entry point is the
+// frame right above profile_sample
+static inline __attribute__((always_inline)) void profile_alloc(void *ptr,
+                                                                size_t size) {
+  const size_t rate = atomic_load_explicit(&profile_rate, memory_order_relaxed);
+  TCache *tc = tcache;
+  if (rate == 0 || ptr == NULL || tc == NULL || profile_busy)
+    return;
+  tc->sample_left -= (int64_t)size;
+  if (tc->sample_left >= 0)
+    return;
+  tc->sample_left = profile_interval(tc, rate);
+  profile_sample(ptr, size, rate);
+}
+
+static void profile_free(FreeBlock *b) {
+  pthread_mutex_lock(&profile_lock);
+  profile_remove((uintptr_t)block_payload(b));
+  pthread_mutex_unlock(&profile_lock);
+  pthread_mutex_lock(&heap_lock);
+  header_and(b, ~BLOCK_SAMPLED);
+  pthread_mutex_unlock(&heap_lock);
+}
+
+static void profile_resize(void *ptr, size_t size) {
+  pthread_mutex_lock(&profile_lock);
+  Sample *s = &profile[profile_find((uintptr_t)ptr)];
+  if (s->ptr != 0)
+    s->size = size;
+  pthread_mutex_unlock(&profile_lock);
+}
+
+// the sample follows a relocated block, profile_lock nests inside heap_lock
+static void profile_move(void *from, void *to) {
+  pthread_mutex_lock(&profile_lock);
+  Sample *s = &profile[profile_find((uintptr_t)from)];
+  if (s->ptr != 0) {
+    Sample moved = *s;
+    moved.ptr = (uintptr_t)to;
+    profile_remove((uintptr_t)from);
+    profile[profile_find((uintptr_t)to)] = moved;
+    profile_len += 1;
+  }
+  pthread_mutex_unlock(&profile_lock);
+}
+
+bool heap_profile_start(size_t rate) {
+  pthread_once(&heap_once, heap_init);
+  pthread_mutex_lock(&profile_lock);
+  if (profile == NULL)
+    profile = page_alloc(PROFILE_SLOTS * sizeof(Sample));
+  const bool ok = profile != NULL;
+  pthread_mutex_unlock(&profile_lock);
+  if (!ok || rate == 0)
+    return false;
+
+  // the unwinder gets loaded on first use, which allocates
+  void *frame;
+  profile_busy = true;
+  backtrace(&frame, 1);
+  profile_busy = false;
+  atomic_store(&profile_used, true);
+  atomic_store(&profile_rate, rate);
+  return true;
+}
+
+void heap_profile_stop(void) { atomic_store(&profile_rate, 0); }
+
+// frames are resolved outside profile_lock, dladdr takes the loader lock
+// which an allocating thread may hold, frames without a symbol come out as
+// object+offset for addr2line
+void heap_profile_dump(int fd) {
+  pthread_mutex_lock(&profile_lock);
+  const size_t len = profile_len;
+  Sample *snap = profile == NULL ? NULL : page_alloc(len * sizeof(Sample) + 1);
+  size_t n = 0;
+  for (size_t i = 0; snap != NULL && i < PROFILE_SLOTS; i++) {
+    if (profile[i].ptr != 0)
+      snap[n++] = profile[i];
+  }
+  pthread_mutex_unlock(&profile_lock);
+
+  for (size_t i = 0; i < n; i++) {
+    for (int f = snap[i].depth - 1; f >= 0; f--) {
+      const char *sep = f > 0 ? ";" : " ";
+      Dl_info info;
+      if (dladdr(snap[i].frames[f], &info) != 0 && info.dli_sname != NULL) {
+        dprintf(fd, "%s%s", info.dli_sname, sep);
+      } else if (info.dli_fname != NULL) {
+        const char *name = strrchr(info.dli_fname, '/');
+        dprintf(fd, "%s+0x%lx%s", name != NULL ? name + 1 : info.dli_fname,
+                (unsigned long)((char *)snap[i].frames[f] -
+                                (char *)info.dli_fbase),
+                sep);
+      } else {
+        dprintf(fd, "%p%s", snap[i].frames[f], sep);
+      }
+    }
+    dprintf(fd, "%.0f\n", snap[i].weight);
+  }
+  page_free(snap, len * sizeof(Sample) + 1);
+}
+
+size_t heap_usable_size(void *ptr) {
+  if (ptr == NULL)
+    return 0;
+  const FreeBlock *b = payload_block(ptr);
+  assert(block_inuse(b));
+  return block_size(b) - BLOCK_HEADER;
+}
+
+// follows thread_alloc, a carve may still leave a block a few bytes larger
+// when the rest is too small to stand on its own
+size_t heap_good_size(size_t size) {
+  pthread_once(&heap_once, heap_init);
+  if (size == 0 || size > HEAP_RESERVE)
+    return 0;
+  size = block_request(size);
+  if (size >= HEAP_MMAP_THRESHOLD)
+    size = page_round(size + offsetof(Mapping, header)) -
+           offsetof(Mapping, header);
+  return size - BLOCK_HEADER;
+}
+
+// everything strictly inside a free chunk can go, the header and footer
+// words keep their pages, heap_lock must be held
+// chunks whose header was not rewritten since they were last trimmed are
+// skipped without a syscall, the others only get the runs of pages that
+// are not handed back yet, so the count is what this call released
+static size_t trim_chunks(void) {
+  size_t trimmed = 0;
+  Chunk c;
+  for (ChunkIter it = chunks_iter(); chunks_next(&it, &c);) {
+    FreeBlock *b = c.start;
+    if (header_get(b) & BLOCK_TRIMMED)
+      continue;
+    header_or(b, BLOCK_TRIMMED);
+    const size_t lo = page_round((char *)b + BLOCK_HEADER - heap) / page_size;
+    const size_t hi = ((char *)b + c.size - sizeof(size_t) - heap) / page_size;
+    for (size_t p = lo; p < hi;) {
+      size_t q = p;
+      while (q < hi && !trim_map_get(q))
+        q++;
+      if (q > p &&
+          madvise(heap + p * page_size, (q - p) * page_size,
+                  HEAP_TRIM_ADVICE) == 0) {
+        trim_map_set(p, q);
+        trimmed += (q - p) * page_size;
+      }
+      for (p = q; p < hi && trim_map_get(p);)
+        p++;
+    }
+  }
+  trim_pending = 0;
+  return trimmed;
+}
+
+size_t heap_trim(void) {
+  if (heap == NULL)
+    return 0;
+  pthread_mutex_lock(&heap_lock);
+  const size_t trimmed = trim_chunks();
+  pthread_mutex_unlock(&heap_lock);
+  return trimmed;
+}
+
+static void *trim_main(void *arg) {
+  (void)arg;
+  const struct timespec delay = {.tv_nsec = HEAP_TRIM_DELAY_MS * 1000000l};
+  pthread_mutex_lock(&heap_lock);
+  for (;;) {
+    while (trim_pending < HEAP_TRIM_THRESHOLD)
+      pthread_cond_wait(&trim_cond, &heap_lock);
+    pthread_mutex_unlock(&heap_lock);
+    nanosleep(&delay, NULL);
+    pthread_mutex_lock(&heap_lock);
+    trim_chunks();
+  }
+  return NULL;
+}
+
+// pthread_create may allocate, so heap_lock is only taken afterwards
+static void trim_start(void) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, trim_main, NULL) != 0)
+    return;
+  pthread_detach(thread);
+  pthread_mutex_lock(&heap_lock);
+  trim_running = true;
+  pthread_mutex_unlock(&heap_lock);
+}
+
+// the whole reservation gets the advice, segments committed later included
+bool heap_hugepage(void) {
+  pthread_once(&heap_once, heap_init);
+  if (heap == NULL || madvise(heap, HEAP_RESERVE, MADV_HUGEPAGE) != 0)
+    return false;
+  pthread_mutex_lock(&heap_lock);
+  heap_grow_min = HEAP_HUGEPAGE;
+  pthread_mutex_unlock(&heap_lock);
+  return true;
+}
+
+bool heap_trim_background(void) {
+  static pthread_once_t trim_once = PTHREAD_ONCE_INIT;
+  pthread_once(&heap_once, heap_init);
+  if (heap == NULL)
+    return false;
+  pthread_once(&trim_once, trim_start);
+  pthread_mutex_lock(&heap_lock);
+  const bool ok = trim_running;
+  pthread_mutex_unlock(&heap_lock);
+  return ok;
+}
+
+void heap_flush(void) {
+  if (tcache != NULL) {
+    remote_flush(tcache);
+    tcache_drain(tcache);
+    for (size_t c = 0; c < NUM_SIZE_CLASS; c++)
+      tcache_flush(tcache, c, 0);
+  }
+  pthread_mutex_lock(&heap_lock);
+  remote_reclaim();
+  pthread_mutex_unlock(&heap_lock);
+}
+
+void heap_dump(void) {
+  pthread_mutex_lock(&heap_lock);
+  printf("Heap(%p, %zu)\n", (void *)heap, heap_size);
+  for (FreeBlock *b = heap_first(); heap != NULL && block_size(b) > 0;
+       b = block_next(b)) {
+    printf("  block %p: size: %zu, %s\n", (void *)b, block_size(b),
+           block_inuse(b) ? "inuse" : "free");
+  }
+  chunks_dump();
+  bin_dump();
+  pthread_mutex_unlock(&heap_lock);
+}
+
+// the clock is read on every STATS_SAMPLE-th call of a thread only, 0 means
+// this call goes untimed
+static uint64_t stats_clock(void) {
+  TCache *tc = tcache;
+  if (tc == NULL || ++tc->ops % STATS_SAMPLE != 0)
+    return 0;
+  return clock_ns();
+}
+
+static void stats_record(int op, uint64_t start) {
+  TCache *tc = tcache;
+  if (tc == NULL)
+    return;
+  counter_add(&tc->stats.calls[op], 1);
+  if (start != 0)
+    counter_add(&tc->stats.latency[op][log2_bucket(clock_ns() - start)], 1);
+}
+
+// free space comes from the bins and chunks_free alone, so the cost grows
+// with the number of free blocks and not with the heap
+HeapStats heap_stats(void) {
+  HeapStats s = {0};
+  Counters sum = {0};
+  pthread_once(&heap_once, heap_init);
+  pthread_mutex_lock(&heap_lock);
+  for (size_t c = 0; c < NUM_SIZE_CLASS; c++) {
+    for (FreeBlock *b = bins[c]; b != NULL; b = b->next) {
+      s.free_blocks += 1;
+      s.bytes_free += class_size(c);
+      s.free_hist[log2_bucket(class_size(c))] += 1;
+    }
+  }
+  Chunk c;
+  for (ChunkIter it = chunks_iter(); chunks_next(&it, &c);) {
+    const size_t size = c.size;
+    s.free_blocks += 1;
+    s.bytes_free += size;
+    s.free_hist[log2_bucket(size)] += 1;
+    if (size > s.largest_free)
+      s.largest_free = size;
+  }
+  if (s.largest_free == 0 && bins_bitmap != 0)
+    s.largest_free = class_size(63 - __builtin_clzll(bins_bitmap));
+  counters_merge(&sum, &retired);
+  for (TCache *tc = tcaches; tc != NULL; tc = tc->next)
+    counters_merge(&sum, &tc->stats);
+  s.heap_size = heap_size;
+  s.bytes_mapped = mappings_size;
+  s.merges = merges;
+  pthread_mutex_unlock(&heap_lock);
+
+  // the first word and the end marker belong to no block
+  const size_t blocks = heap == NULL ? 0 : heap_size - 2 * BLOCK_HEADER;
+  s.bytes_cached = sum.bytes_cached;
+  s.bytes_inuse = blocks - s.bytes_free - s.bytes_cached;
+  s.fragmentation =
+      s.bytes_free == 0 ? 0.0 : 1.0 - (double)s.largest_free / s.bytes_free;
+  s.allocs = sum.calls[STATS_ALLOC];
+  s.frees = sum.calls[STATS_FREE];
+  s.reallocs = sum.calls[STATS_REALLOC];
+  for (size_t i = 0; i < HEAP_STATS_BUCKETS; i++) {
+    s.alloc_ns[i] = sum.latency[STATS_ALLOC][i];
+    s.free_ns[i] = sum.latency[STATS_FREE][i];
+    s.realloc_ns[i] = sum.latency[STATS_REALLOC][i];
+  }
+  return s;
+}
+
+// histograms become objects keyed by the lower bound of each non-empty
+// bucket
+static void stats_dump_hist(int fd, const char *name, const uint64_t *hist) {
+  dprintf(fd, "  \"%s\": {", name);
+  const char *sep = "";
+  for (size_t i = 0; i < HEAP_STATS_BUCKETS; i++) {
+    if (hist[i] == 0)
+      continue;
+    dprintf(fd, "%s\"%llu\": %llu", sep, 1ull << i,
+            (unsigned long long)hist[i]);
+    sep = ", ";
+  }
+  dprintf(fd, "}");
+}
+
+void heap_stats_dump(int fd) {
+  const HeapStats s = heap_stats();
+  dprintf(fd,
+          "{\n"
+          "  \"heap_size\": %zu,\n"
+          "  \"bytes_mapped\": %zu,\n"
+          "  \"bytes_inuse\": %zu,\n"
+          "  \"bytes_cached\": %zu,\n"
+          "  \"bytes_free\": %zu,\n"
+          "  \"free_blocks\": %zu,\n"
+          "  \"largest_free\": %zu,\n"
+          "  \"fragmentation\": %.4f,\n"
+          "  \"allocs\": %llu,\n"
+          "  \"frees\": %llu,\n"
+          "  \"reallocs\": %llu,\n"
+          "  \"merges\": %llu,\n",
+          s.heap_size, s.bytes_mapped, s.bytes_inuse, s.bytes_cached,
+          s.bytes_free, s.free_blocks, s.largest_free, s.fragmentation,
+          (unsigned long long)s.allocs, (unsigned long long)s.frees,
+          (unsigned long long)s.reallocs, (unsigned long long)s.merges);
+  stats_dump_hist(fd, "free_hist", s.free_hist);
+  dprintf(fd, ",\n");
+  stats_dump_hist(fd, "alloc_ns", s.alloc_ns);
+  dprintf(fd, ",\n");
+  stats_dump_hist(fd, "free_ns", s.free_ns);
+  dprintf(fd, ",\n");
+  stats_dump_hist(fd, "realloc_ns", s.realloc_ns);
+  dprintf(fd, "\n}\n");
+}
+
+static void *thread_alloc(size_t size) {
+  TCache *tc = tcache_get();
+  if (size == 0 || size > HEAP_RESERVE || tc == NULL)
+    return NULL;
+
+  size = block_request(size);
+  FreeBlock *b = NULL;
+  if (size <= SIZE_CLASS_MAX) {
+    b = tcache_pop(tc, size_class(size));
+    if (b == NULL &&
+        atomic_load_explicit(&tc->remote, memory_order_relaxed) != NULL) {
+      tcache_drain(tc);
+      b = tcache_pop(tc, size_class(size));
+    }
+    if (b == NULL)
+      b = tcache_refill(tc, size);
+  } else if (size >= HEAP_MMAP_THRESHOLD) {
+    b = mapping_alloc(size);
+  } else {
+    remote_flush(tc);
+    pthread_mutex_lock(&heap_lock);
+    b = central_alloc(size);
+    pthread_mutex_unlock(&heap_lock);
+  }
+  return b == NULL ? NULL : block_payload(b);
+}
+
+static void thread_free(void *ptr) {
+  if (ptr == NULL)
+    return;
+
+  FreeBlock *b = payload_block(ptr);
+  assert(block_inuse(b));
+  if (header_get(b) & BLOCK_SAMPLED)
+    profile_free(b);
+  if (header_get(b) & BLOCK_MMAPPED) {
+    mapping_free(b);
+    return;
+  }
+  TCache *tc = tcache_get();
+  const size_t size = block_size(b);
+  if (size <= SIZE_CLASS_MAX && tc != NULL) {
+    const uint32_t owner = block_owner(b);
+    if (owner != 0 && owner != tc->id) {
+      remote_free(tc, owner, b);
+      return;
+    }
+    const size_t c = size_class(size);
+    tcache_push(tc, b, c);
+    if (tc->counts[c] > TCACHE_LIMIT)
+      tcache_flush(tc, c, TCACHE_LIMIT - TCACHE_BATCH);
+  } else {
+    if (tc != NULL)
+      remote_flush(tc);
+    pthread_mutex_lock(&heap_lock);
+    block_free(b);
+    pthread_mutex_unlock(&heap_lock);
+  }
+}
+
+void *heap_alloc(size_t size) {
+  const uint64_t start = stats_clock();
+  void *ptr = thread_alloc(size);
+  stats_record(STATS_ALLOC, start);
+  profile_alloc(ptr, size);
+  trace_event(HEAP_TRACE_ALLOC, ptr, NULL, size);
+  return ptr;
+}
+
+void *heap_alloc_aligned(size_t size, size_t align) {
+  if (align == 0 || (align & (align - 1)) != 0)
+    return NULL;
+  if (align <= SIZE_CLASS_STEP)
+    return heap_alloc(size);
+  if (size == 0 || size > HEAP_RESERVE || align > HEAP_RESERVE ||
+      tcache_get() == NULL)
+    return NULL;
+
+  const uint64_t start = stats_clock();
+  const size_t bsize = block_request(size);
+  FreeBlock *b;
+  if (bsize >= HEAP_MMAP_THRESHOLD) {
+    b = mapping_alloc_aligned(bsize, align);
+  } else {
+    pthread_mutex_lock(&heap_lock);
+    b = central_alloc_aligned(bsize, align);
+    pthread_mutex_unlock(&heap_lock);
+  }
+  void *ptr = b == NULL ? NULL : block_payload(b);
+  stats_record(STATS_ALLOC, start);
+  profile_alloc(ptr, size);
+  trace_event(HEAP_TRACE_ALLOC, ptr, NULL, size);
+  return ptr;
+}
+
+// blocks come from the thread cache first, the rest from a single run cut
+// under one lock, or from one mapping each once they are that big
+size_t heap_alloc_batch(size_t size, size_t n, void **out) {
+  TCache *tc = tcache_get();
+  if (size == 0 || size > HEAP_RESERVE || tc == NULL)
+    return 0;
+
+  const uint64_t start = stats_clock();
+  const size_t bsize = block_request(size);
+  size_t got = 0;
+  FreeBlock *b;
+  if (bsize <= SIZE_CLASS_MAX) {
+    while (got < n && (b = tcache_pop(tc, size_class(bsize))) != NULL)
+      out[got++] = block_payload(b);
+  }
+  if (bsize >= HEAP_MMAP_THRESHOLD) {
+    for (; got < n && (b = mapping_alloc(bsize)) != NULL; got++)
+      out[got] = block_payload(b);
+  } else if (got < n) {
+    // the block pointers go into `out` first and become payloads after
+    FreeBlock **blocks = (FreeBlock **)(out + got);
+    const size_t want = n - got;
+    size_t carved = 0;
+    pthread_mutex_lock(&heap_lock);
+    FreeBlock *run =
+        want <= HEAP_RESERVE / bsize ? central_alloc(bsize * want) : NULL;
+    if (run != NULL) {
+      run_split(run, bsize, want, blocks, tc->id);
+      carved = want;
+    } else {
+      for (; carved < want && (b = central_alloc(bsize)) != NULL; carved++)
+        blocks[carved] = b;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    for (size_t i = 0; i < carved; i++)
+      out[got + i] = block_payload(blocks[i]);
+    got += carved;
+  }
+
+  counter_add(&tc->stats.calls[STATS_ALLOC], got);
+  if (start != 0)
+    counter_add(
+        &tc->stats.latency[STATS_ALLOC][log2_bucket(clock_ns() - start)], 1);
+  for (size_t i = 0; i < got; i++) {
+    profile_alloc(out[i], size);
+    trace_event(HEAP_TRACE_ALLOC, out[i], NULL, size);
+  }
+  return got;
+}
+
+// grow into the free right neighbour, and into fresh heap when the block
+// is the last one, heap_lock must be held
+static bool block_extend(FreeBlock *b, size_t size) {
+  FreeBlock *next = block_next(b);
+  size_t avail = block_size(b);
+  if (!block_inuse(next))
+    avail += block_size(next);
+  if (avail < size) {
+    FreeBlock *after = block_inuse(next) ? next : block_next(next);
+    if (after != heap_end() || !heap_grow(size - avail))
+      return false;
+    next = block_next(b);
+    avail = block_size(b) + block_size(next);
+  }
+
+  if (!block_inuse(next)) {
+    free_remove(next);
+    trim_map_clear(next, block_size(next));
+    header_set(b, avail | (header_get(b) & BLOCK_FLAGS));
+    header_or(block_next(b), BLOCK_PREV_INUSE);
+  }
+  block_shrink(b, size);
+  return true;
+}
+
+void *heap_realloc(void *ptr, size_t size) {
+  if (ptr == NULL)
+    return heap_alloc(size);
+  if (size == 0) {
+    heap_free(ptr);
+    return NULL;
+  }
+  if (size > HEAP_RESERVE)
+    return NULL;
+
+  const uint64_t start = stats_clock();
+  FreeBlock *b = payload_block(ptr);
+  assert(block_inuse(b));
+  const size_t need = block_request(size);
+  const size_t cur = block_size(b);
+  if (need <= cur && cur - need < BLOCK_MIN) {
+    if (header_get(b) & BLOCK_SAMPLED)
+      profile_resize(ptr, size);
+    stats_record(STATS_REALLOC, start);
+    trace_event(HEAP_TRACE_REALLOC, ptr, ptr, size);
+    return ptr;
+  }
+
+  void *ret = ptr;
+  bool done = true;
+  bool sampled = false;
+  if (header_get(b) & BLOCK_MMAPPED) {
+    // mremap may move the block, a sample of it starts over
+    if (header_get(b) & BLOCK_SAMPLED)
+      profile_free(b);
+    FreeBlock *n =
+        need >= HEAP_MMAP_THRESHOLD ? mapping_resize(b, need) : NULL;
+    done = n != NULL;
+    if (done)
+      ret = block_payload(n);
+  } else {
+    pthread_mutex_lock(&heap_lock);
+    if (need <= cur) {
+      block_shrink(b, need);
+    } else {
+      done = block_extend(b, need);
+    }
+    sampled = header_get(b) & BLOCK_SAMPLED;
+    pthread_mutex_unlock(&heap_lock);
+  }
+
+  if (!done) {
+    ret = thread_alloc(size);
+    if (ret != NULL) {
+      memcpy(ret, ptr, (need < cur ? need : cur) - BLOCK_HEADER);
+      thread_free(ptr);
+    }
+  } else if (sampled) {
+    profile_resize(ptr, size);
+  }
+  stats_record(STATS_REALLOC, start);
+  profile_alloc(ret, size);
+  trace_event(HEAP_TRACE_REALLOC, ret, ptr, size);
+  return ret;
+}
+
+// the event goes out first, once the block is back another thread may get
+// the same address
+void heap_free(void *ptr) {
+  if (ptr == NULL)
+    return;
+  trace_event(HEAP_TRACE_FREE, ptr, NULL, 0);
+  const uint64_t start = stats_clock();
+  thread_free(ptr);
+  stats_record(STATS_FREE, start);
+}
+
+// the size rules out big blocks and the profiler without decoding the
+// header flags, the bin still comes from the block itself since a split
+// remainder, a shrinking realloc or an aligned carve can leave it a class
+// or more above what was asked for
+void heap_free_sized(void *ptr, size_t size) {
+  TCache *tc = tcache;
+  if (ptr == NULL || tc == NULL || block_request(size) > SIZE_CLASS_MAX ||
+      atomic_load_explicit(&profile_used, memory_order_relaxed)) {
+    heap_free(ptr);
+    return;
+  }
+
+  FreeBlock *b = payload_block(ptr);
+  const size_t bsize = block_size(b);
+  assert(block_inuse(b) && bsize >= block_request(size));
+  if (bsize > SIZE_CLASS_MAX) {
+    heap_free(ptr);
+    return;
+  }
+  trace_event(HEAP_TRACE_FREE, ptr, NULL, 0);
+  const uint64_t start = stats_clock();
+  const uint32_t owner = block_owner(b);
+  if (owner != 0 && owner != tc->id) {
+    remote_free(tc, owner, b);
+  } else {
+    const size_t c = size_class(bsize);
+    tcache_push(tc, b, c);
+    if (tc->counts[c] > TCACHE_LIMIT)
+      tcache_flush(tc, c, TCACHE_LIMIT - TCACHE_BATCH);
+  }
+  stats_record(STATS_FREE, start);
+}
+
+// only free chunks are considered, they are address ordered so the first
+// fit is also the lowest one, and a block that moves always moves down
+void *heap_relocate(void *ptr) {
+  FreeBlock *b = payload_block(ptr);
+  assert(block_inuse(b));
+  if (header_get(b) & BLOCK_MMAPPED)
+    return NULL;
+
+  pthread_mutex_lock(&heap_lock);
+  const size_t size = block_size(b);
+  FreeBlock *n = chunks_alloc(size, b);
+  if (n != NULL) {
+    block_carve(n, size);
+    memcpy(block_payload(n), ptr, size - BLOCK_HEADER);
+    if (header_get(b) & BLOCK_SAMPLED) {
+      profile_move(ptr, block_payload(n));
+      header_or(n, BLOCK_SAMPLED);
+    }
+    block_free(b);
+  }
+  pthread_mutex_unlock(&heap_lock);
+
+  if (n == NULL)
+    return NULL;
+  trace_event(HEAP_TRACE_REALLOC, block_payload(n), ptr, size - BLOCK_HEADER);
+  return block_payload(n);
+}
+
+// state of one collection, blocks[] lists every in-use block in address
+// order and marks[] says what became of it, first[g] is the index of the
+// first block starting at or past granule g of the heap so a lookup only
+// searches the few blocks of one granule
+typedef struct {
+  FreeBlock **blocks;
+  unsigned char *marks;
+  FreeBlock **stack;
+  uint32_t *first;
+  size_t size;
+  size_t granules;
+  size_t top;
+} Collector;
+
+#define COLLECT_GRANULE_SHIFT 8
+
+enum { MARK_NONE, MARK_LIVE, MARK_CACHED };
+
+// index of the block whose payload contains `ptr`, or -1
+static long collector_find(const Collector *gc, uintptr_t ptr) {
+  if (ptr < (uintptr_t)heap || ptr >= (uintptr_t)heap + heap_size)
+    return -1;
+
+  const size_t g = (ptr - (uintptr_t)heap) >> COLLECT_GRANULE_SHIFT;
+  size_t lo = gc->first[g], hi = gc->first[g + 1];
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if ((uintptr_t)gc->blocks[mid] <= ptr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0)
+    return -1;
+  const FreeBlock *b = gc->blocks[lo - 1];
+  if (ptr < (uintptr_t)b + BLOCK_HEADER || ptr >= (uintptr_t)block_next(b))
+    return -1;
+  return lo - 1;
+}
+
+// treat every aligned word in [lo, hi) as a potential pointer, stack frames
+// and globals are read past their bounds on purpose
+static __attribute__((no_sanitize_address)) void
+collector_scan(Collector *gc, const void *lo, const void *hi) {
+  const uintptr_t align = sizeof(void *) - 1;
+  const uintptr_t *p = (const uintptr_t *)(((uintptr_t)lo + align) & ~align);
+  for (; (const void *)(p + 1) <= hi; p++) {
+    const long i = collector_find(gc, *p);
+    if (i >= 0 && gc->marks[i] == MARK_NONE) {
+      gc->marks[i] = MARK_LIVE;
+      gc->stack[gc->top++] = gc->blocks[i];
+    }
+  }
+}
+
+// marked blocks wait COLLECT_PREFETCH pops in a ring after their header
+// is prefetched, so the cache misses of several scans overlap
+#define COLLECT_PREFETCH 8
+
+static void collector_drain(Collector *gc) {
+  FreeBlock *ring[COLLECT_PREFETCH];
+  size_t head = 0, len = 0;
+  while (gc->top > 0 || len > 0) {
+    for (; gc->top > 0 && len < COLLECT_PREFETCH; len++) {
+      FreeBlock *b = gc->stack[--gc->top];
+      __builtin_prefetch(b);
+      ring[(head + len) % COLLECT_PREFETCH] = b;
+    }
+    FreeBlock *b = ring[head];
+    head = (head + 1) % COLLECT_PREFETCH;
+    len -= 1;
+    collector_scan(gc, block_payload(b), block_next(b));
+  }
+}
+
+static int collector_scan_segments(struct dl_phdr_info *info, size_t size,
+                                   void *arg) {
+  (void)size;
+  for (size_t i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+    if (ph->p_type == PT_LOAD && (ph->p_flags & PF_W)) {
+      const char *lo = (const char *)(info->dlpi_addr + ph->p_vaddr);
+      collector_scan(arg, lo, lo + ph->p_memsz);
+    }
+  }
+  return 0;
+}
+
+// spill the callee-saved registers into a jmp_buf on this frame so that the
+// scan from here to the top of the stack sees them too
+static __attribute__((noinline)) void collector_scan_stack(Collector *gc) {
+  jmp_buf regs;
+  setjmp(regs);
+
+  pthread_attr_t attr;
+  void *addr;
+  size_t size;
+  pthread_getattr_np(pthread_self(), &attr);
+  pthread_attr_getstack(&attr, &addr, &size);
+  pthread_attr_destroy(&attr);
+  collector_scan(gc, &regs, (char *)addr + size);
+}
+
+// rebuild the free structures in one walk, every run of free and garbage
+// blocks becomes a single free block appended in address order
+static void collector_sweep(Collector *gc, HeapCollectStats *stats) {
+  memset(bins, 0, sizeof(bins));
+  bins_bitmap = 0;
+  chunks_clear();
+
+  size_t i = 0;
+  FreeBlock *b = heap_first();
+  while (block_size(b) > 0) {
+    FreeBlock *run = NULL;
+    size_t size = 0;
+    for (; block_size(b) > 0; b = block_next(b)) {
+      if (block_inuse(b)) {
+        if (gc->marks[i++] != MARK_NONE)
+          break;
+        trace_event(HEAP_TRACE_FREE, block_payload(b), NULL, 0);
+        if (header_get(b) & BLOCK_SAMPLED) {
+          pthread_mutex_lock(&profile_lock);
+          profile_remove((uintptr_t)block_payload(b));
+          pthread_mutex_unlock(&profile_lock);
+        }
+        stats->blocks_freed += 1;
+        stats->bytes_freed += block_size(b);
+      }
+      if (run == NULL)
+        run = b;
+      size += block_size(b);
+    }
+    if (run != NULL) {
+      block_set_free(run, size);
+      free_insert(run);
+    }
+    if (block_size(b) > 0)
+      b = block_next(b);
+  }
+}
+
+HeapCollectStats heap_collect(void) {
+  const uint64_t start = clock_ns();
+  HeapCollectStats stats = {0};
+  heap_flush();
+  if (heap == NULL)
+    return stats;
+
+  // only the calling thread's stack and registers are scanned, a block
+  // that another live thread alone points to would be swept
+  pthread_mutex_lock(&heap_lock);
+  if (tcaches_live > (tcache != NULL)) {
+    pthread_mutex_unlock(&heap_lock);
+    stats.refused = true;
+    stats.pause_ns = clock_ns() - start;
+    return stats;
+  }
+
+  Collector gc = {0};
+  for (FreeBlock *b = heap_first(); block_size(b) > 0; b = block_next(b))
+    gc.size += block_inuse(b);
+  gc.granules = (heap_size >> COLLECT_GRANULE_SHIFT) + 1;
+  gc.blocks = page_alloc(gc.size * sizeof(FreeBlock *) + 1);
+  gc.stack = page_alloc(gc.size * sizeof(FreeBlock *) + 1);
+  gc.marks = page_alloc(gc.size + 1);
+  gc.first = page_alloc((gc.granules + 1) * sizeof(uint32_t));
+  if (gc.blocks == NULL || gc.stack == NULL || gc.marks == NULL ||
+      gc.first == NULL || gc.size > UINT32_MAX) {
+    fprintf(stderr, "Error: heap collect %zu blocks\n", gc.size);
+    abort();
+  }
+  size_t n = 0, g = 0;
+  for (FreeBlock *b = heap_first(); block_size(b) > 0; b = block_next(b)) {
+    if (!block_inuse(b))
+      continue;
+    for (; (g << COLLECT_GRANULE_SHIFT) <= (size_t)((char *)b - heap); g++)
+      gc.first[g] = n;
+    gc.blocks[n++] = b;
+  }
+  for (; g <= gc.granules; g++)
+    gc.first[g] = n;
+
+  // blocks parked in other threads' caches are neither roots nor garbage
+  for (TCache *tc = tcaches; tc != NULL; tc = tc->next) {
+    for (size_t c = 0; c < NUM_SIZE_CLASS; c++)
+      for (FreeBlock *b = tc->bins[c]; b != NULL; b = b->next)
+        gc.marks[collector_find(&gc, (uintptr_t)block_payload(b))] =
+            MARK_CACHED;
+    for (FreeBlock *b = atomic_load(&tc->remote); b != NULL; b = b->next)
+      gc.marks[collector_find(&gc, (uintptr_t)block_payload(b))] =
+          MARK_CACHED;
+    for (FreeBlock *b = tc->pending; b != NULL; b = b->next)
+      gc.marks[collector_find(&gc, (uintptr_t)block_payload(b))] =
+          MARK_CACHED;
+  }
+
+  collector_scan_stack(&gc);
+  collector_drain(&gc);
+  dl_iterate_phdr(collector_scan_segments, &gc);
+  collector_drain(&gc);
+  // mapped blocks are never collected, they only hold pointers into the heap
+  for (Mapping *m = mappings; m != NULL; m = m->next)
+    collector_scan(&gc, m + 1, (char *)m + m->len);
+  collector_drain(&gc);
+
+  collector_sweep(&gc, &stats);
+  stats.blocks_live = gc.size - stats.blocks_freed;
+  pthread_mutex_unlock(&heap_lock);
+
+  page_free(gc.blocks, gc.size * sizeof(FreeBlock *) + 1);
+  page_free(gc.stack, gc.size * sizeof(FreeBlock *) + 1);
+  page_free(gc.marks, gc.size + 1);
+  page_free(gc.first, (gc.granules + 1) * sizeof(uint32_t));
+  stats.pause_ns = clock_ns() - start;
+  return stats;
+}
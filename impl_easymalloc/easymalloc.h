@@ -0,0 +1,112 @@
+#ifndef EASYMALLOC_H_
+#define EASYMALLOC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// `refused` is set when another thread still had a live cache, nothing is
+// freed then
+typedef struct {
+  bool refused;
+  size_t blocks_live;
+  size_t blocks_freed;
+  size_t bytes_freed;
+  uint64_t pause_ns;
+} HeapCollectStats;
+
+// histograms count values by floor(log2), the last bucket takes the rest
+#define HEAP_STATS_BUCKETS 48
+
+// a snapshot from heap_stats, byte counts cover whole blocks headers
+// included, latencies are sampled from one call in 64
+typedef struct {
+  size_t heap_size;    // committed part of the reservation
+  size_t bytes_mapped; // in blocks with a mapping of their own
+  size_t bytes_inuse;  // held by the program
+  size_t bytes_cached; // freed but parked in thread caches
+  size_t bytes_free;
+  size_t free_blocks;
+  size_t largest_free;
+  double fragmentation; // 1 - largest_free / bytes_free
+  uint64_t free_hist[HEAP_STATS_BUCKETS];
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t reallocs;
+  uint64_t merges; // neighbours coalesced on free
+  uint64_t alloc_ns[HEAP_STATS_BUCKETS];
+  uint64_t free_ns[HEAP_STATS_BUCKETS];
+  uint64_t realloc_ns[HEAP_STATS_BUCKETS];
+} HeapStats;
+
+// a trace file is HEAP_TRACE_MAGIC followed by one HeapTraceEvent per call,
+// the low byte of size_op is the operation and the rest the requested size
+#define HEAP_TRACE_MAGIC "emtrace1"
+#define HEAP_TRACE_OP(e) ((int)((e)->size_op & 0xff))
+#define HEAP_TRACE_SIZE(e) ((size_t)((e)->size_op >> 8))
+
+enum { HEAP_TRACE_ALLOC = 1, HEAP_TRACE_FREE, HEAP_TRACE_REALLOC };
+
+typedef struct {
+  uint64_t ts;  // nanoseconds since heap_trace_start
+  uint64_t ptr; // block returned, or freed
+  uint64_t old; // block handed to realloc
+  uint64_t size_op;
+} HeapTraceEvent;
+
+// every pointer is aligned for any object type, see max_align_t, blocks of
+// 256K and up get a mapping of their own that free unmaps
+void *heap_alloc(size_t size);
+// `align` must be a power of two, the padding in front of and behind the
+// block goes back to the heap, or is unmapped for blocks of 256K and up
+void *heap_alloc_aligned(size_t size, size_t align);
+// resize in place when shrinking or when the next block is free, move the
+// data only as a last resort
+void *heap_realloc(void *ptr, size_t size);
+// allocate `n` blocks of `size` bytes into out[], returns how many it got,
+// those come first
+size_t heap_alloc_batch(size_t size, size_t n, void **out);
+void heap_free(void *ptr);
+// `size` must be what the block was last allocated or resized to
+void heap_free_sized(void *ptr, size_t size);
+// move the block into a free chunk at a lower address, returns the new
+// address or NULL when there is none, the caller must own every pointer to
+// the block
+void *heap_relocate(void *ptr);
+// bytes the block behind `ptr` can actually hold, at least what was asked for
+size_t heap_usable_size(void *ptr);
+// what heap_usable_size reports for a fresh heap_alloc(size), requests are
+// rounded up to their size class or to whole pages, a container can ask for
+// this much right away and use all of it
+size_t heap_good_size(size_t size);
+// hand the blocks cached by the calling thread back to the central heap
+void heap_flush(void);
+// release the pages inside free chunks to the OS, returns the bytes released
+size_t heap_trim(void);
+// back the heap with transparent huge pages from now on
+bool heap_hugepage(void);
+// start a thread that trims shortly after a burst of frees, once per process
+bool heap_trim_background(void);
+// conservative mark and sweep, frees every block that no word on the calling
+// thread's stack, in its registers, in writable globals or in another live
+// block points into, refused while any other thread that used the heap is
+// still running since its stack is not scanned, a thread that never called
+// into the heap is not seen at all, mapped blocks are never collected
+HeapCollectStats heap_collect(void);
+void heap_dump(void);
+HeapStats heap_stats(void);
+// heap_stats as a JSON object written to `fd`
+void heap_stats_dump(int fd);
+// sample about one allocation per `rate` bytes with its call stack, samples
+// stay in the profile until their blocks are freed, also after
+// heap_profile_stop
+bool heap_profile_start(size_t rate);
+void heap_profile_stop(void);
+// the live samples in folded-stack format, one `root;...;leaf bytes` line
+// each, bytes are scaled up to estimate all allocations from that stack
+void heap_profile_dump(int fd);
+// record every alloc, realloc and free to `path` until heap_trace_stop
+bool heap_trace_start(const char *path);
+void heap_trace_stop(void);
+
+#endif // EASYMALLOC_H_
@@ -0,0 +1,96 @@
+#include <assert.h>
+#include <stdint.h>
+
+#include "easymalloc.h"
+#include "handle.h"
+
+// looking at an entry that cannot move is charged like copying this many
+// bytes, so a pass over a fully pinned table still ends
+#define HANDLE_VISIT_COST 64
+
+static HandleEntry *handle_entry(HandleTable *t, hhandle_t h) {
+  assert(h != HHANDLE_NULL && h <= t->size);
+  HandleEntry *e = &t->entries[h - 1];
+  assert(e->ptr != NULL);
+  return e;
+}
+
+void handle_table_init(HandleTable *t) {
+  *t = (HandleTable){0};
+}
+
+// freed entries are recycled before the table grows
+hhandle_t hhandle_alloc(HandleTable *t, size_t size) {
+  if (t->free == 0 && t->size == t->cap) {
+    const uint32_t cap = t->cap < 16 ? 16 : t->cap * 2;
+    HandleEntry *entries = heap_realloc(t->entries, cap * sizeof(HandleEntry));
+    if (entries == NULL)
+      return HHANDLE_NULL;
+    t->entries = entries;
+    t->cap = cap;
+  }
+  void *ptr = heap_alloc(size);
+  if (ptr == NULL)
+    return HHANDLE_NULL;
+
+  uint32_t i;
+  if (t->free != 0) {
+    i = t->free - 1;
+    t->free = t->entries[i].next_free;
+  } else {
+    i = t->size++;
+  }
+  t->entries[i] = (HandleEntry){.ptr = ptr};
+  return i + 1;
+}
+
+void hhandle_free(HandleTable *t, hhandle_t h) {
+  if (h == HHANDLE_NULL)
+    return;
+  HandleEntry *e = handle_entry(t, h);
+  assert(e->pins == 0);
+  heap_free(e->ptr);
+  e->ptr = NULL;
+  e->next_free = t->free;
+  t->free = h;
+}
+
+void *hhandle_lock(HandleTable *t, hhandle_t h) {
+  HandleEntry *e = handle_entry(t, h);
+  e->pins += 1;
+  return e->ptr;
+}
+
+void hhandle_unlock(HandleTable *t, hhandle_t h) {
+  HandleEntry *e = handle_entry(t, h);
+  assert(e->pins > 0);
+  e->pins -= 1;
+}
+
+// every move lands strictly lower, so repeated calls settle once the live
+// blocks sit packed below the free space, which heap_trim can then return
+size_t handle_compact(HandleTable *t, size_t budget) {
+  size_t moved = 0, spent = 0;
+  for (uint32_t n = 0; n < t->size && spent < budget; n++) {
+    if (t->cursor >= t->size)
+      t->cursor = 0;
+    HandleEntry *e = &t->entries[t->cursor++];
+    spent += HANDLE_VISIT_COST;
+    if (e->ptr == NULL || e->pins > 0)
+      continue;
+    void *ptr = heap_relocate(e->ptr);
+    if (ptr != NULL) {
+      e->ptr = ptr;
+      moved += heap_usable_size(ptr);
+      spent += heap_usable_size(ptr);
+    }
+  }
+  return moved;
+}
+
+void handle_table_destroy(HandleTable *t) {
+  for (uint32_t i = 0; i < t->size; i++)
+    heap_free(t->entries[i].ptr);
+  heap_free(t->entries);
+  *t = (HandleTable){0};
+}
@@ -0,0 +1,41 @@
+#ifndef HANDLE_H_
+#define HANDLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// relocatable blocks, the program keeps a handle and asks for the address
+// only while it works on the block, every block not pinned by a lock may be
+// slid to a lower address by handle_compact, a table is not thread safe
+typedef uint32_t hhandle_t;
+
+#define HHANDLE_NULL 0
+
+typedef struct {
+  void *ptr;
+  uint32_t pins;
+  uint32_t next_free;
+} HandleEntry;
+
+typedef struct {
+  HandleEntry *entries;
+  uint32_t size;
+  uint32_t cap;
+  uint32_t free; // index + 1 of the first recycled entry, 0 if none
+  uint32_t cursor;
+} HandleTable;
+
+void handle_table_init(HandleTable *t);
+hhandle_t hhandle_alloc(HandleTable *t, size_t size);
+void hhandle_free(HandleTable *t, hhandle_t h);
+// pins the block, the address stays valid until the matching unlock, locks
+// nest
+void *hhandle_lock(HandleTable *t, hhandle_t h);
+void hhandle_unlock(HandleTable *t, hhandle_t h);
+// relocate unpinned blocks into free space further down until about
+// `budget` bytes of work are spent, resumes where the last call stopped,
+// returns the bytes moved
+size_t handle_compact(HandleTable *t, size_t budget);
+void handle_table_destroy(HandleTable *t);
+
+#endif // HANDLE_H_
@@ -0,0 +1,258 @@
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "easymalloc.h"
+
+// replays a trace recorded with heap_trace_start (or EASYMALLOC_TRACE through
+// libeasymalloc.so) against easymalloc and glibc, every allocator runs in its
+// own child so footprints do not mix
+//
+//   ./replay trace.bin
+typedef struct {
+  const char *name;
+  void *(*malloc)(size_t);
+  void *(*realloc)(void *, size_t);
+  void (*free)(void *);
+} Allocator;
+
+// pointers of the trace are renamed to dense ids, ids of freed blocks are
+// handed out again so the replay table stays as small as the live set
+typedef struct {
+  uint32_t op;
+  uint32_t id;
+  size_t size;
+} Op;
+
+typedef struct {
+  Op *ops;
+  size_t len;
+  size_t num_ids;
+  size_t peak_live;
+} Trace;
+
+typedef struct {
+  uint64_t *keys;
+  uint32_t *ids;
+  size_t cap;
+} IdMap;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t rss_bytes(void) {
+  long pages = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f != NULL) {
+    if (fscanf(f, "%*d %ld", &pages) != 1)
+      pages = 0;
+    fclose(f);
+  }
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+static size_t idmap_slot(const IdMap *m, uint64_t key) {
+  size_t i = (key >> 4) * 0x9e3779b97f4a7c15ull & (m->cap - 1);
+  while (m->keys[i] != 0 && m->keys[i] != key)
+    i = (i + 1) & (m->cap - 1);
+  return i;
+}
+
+// backward shift keeps probe chains intact without tombstones
+static void idmap_remove(IdMap *m, size_t i) {
+  size_t j = i;
+  for (;;) {
+    m->keys[i] = 0;
+    for (;;) {
+      j = (j + 1) & (m->cap - 1);
+      if (m->keys[j] == 0)
+        return;
+      const size_t home = (m->keys[j] >> 4) * 0x9e3779b97f4a7c15ull &
+                          (m->cap - 1);
+      if (((j - home) & (m->cap - 1)) >= ((j - i) & (m->cap - 1)))
+        break;
+    }
+    m->keys[i] = m->keys[j];
+    m->ids[i] = m->ids[j];
+    i = j;
+  }
+}
+
+static Trace trace_load(const char *path) {
+  Trace t = {0};
+  const int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < 8) {
+    fprintf(stderr, "replay: cannot read %s\n", path);
+    exit(1);
+  }
+  const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED || memcmp(data, HEAP_TRACE_MAGIC, 8) != 0) {
+    fprintf(stderr, "replay: %s is not a trace\n", path);
+    exit(1);
+  }
+  const HeapTraceEvent *events = (const HeapTraceEvent *)(data + 8);
+  const size_t len = (st.st_size - 8) / sizeof(HeapTraceEvent);
+
+  // the live set never exceeds the number of events
+  IdMap m = {.cap = 16};
+  while (m.cap < 2 * len)
+    m.cap *= 2;
+  m.keys = calloc(m.cap, sizeof(uint64_t));
+  m.ids = malloc(m.cap * sizeof(uint32_t));
+  uint32_t *free_ids = malloc((len + 1) * sizeof(uint32_t));
+  size_t *sizes = malloc((len + 1) * sizeof(size_t));
+  t.ops = malloc((len + 1) * sizeof(Op));
+  size_t num_free = 0, live = 0;
+
+  for (size_t e = 0; e < len; e++) {
+    const HeapTraceEvent *ev = &events[e];
+    const size_t size = HEAP_TRACE_SIZE(ev);
+    int op = HEAP_TRACE_OP(ev);
+    uint32_t id;
+
+    // frees of blocks from before the trace started are dropped, a realloc of
+    // one becomes a fresh allocation, a failed realloc changes nothing
+    const uint64_t key = op == HEAP_TRACE_FREE ? ev->ptr : ev->old;
+    size_t i = key == 0 ? 0 : idmap_slot(&m, key);
+    const int known = key != 0 && m.keys[i] == key;
+    if (op == HEAP_TRACE_FREE) {
+      if (!known)
+        continue;
+      id = m.ids[i];
+      idmap_remove(&m, i);
+      live -= sizes[id];
+      free_ids[num_free++] = id;
+      t.ops[t.len++] = (Op){HEAP_TRACE_FREE, id, 0};
+      continue;
+    }
+    if (ev->ptr == 0)
+      continue;
+    if (op == HEAP_TRACE_REALLOC && known) {
+      id = m.ids[i];
+      idmap_remove(&m, i);
+      live -= sizes[id];
+    } else {
+      op = HEAP_TRACE_ALLOC;
+      id = num_free > 0 ? free_ids[--num_free] : (uint32_t)t.num_ids++;
+    }
+
+    i = idmap_slot(&m, ev->ptr);
+    if (m.keys[i] == ev->ptr) {
+      // the free of the previous owner raced past this event, forget it
+      live -= sizes[m.ids[i]];
+      free_ids[num_free++] = m.ids[i];
+      t.ops[t.len++] = (Op){HEAP_TRACE_FREE, m.ids[i], 0};
+    }
+    m.keys[i] = ev->ptr;
+    m.ids[i] = id;
+    sizes[id] = size;
+    live += size;
+    if (live > t.peak_live)
+      t.peak_live = live;
+    t.ops[t.len++] = (Op){op, id, size};
+  }
+
+  munmap((void *)data, st.st_size);
+  free(m.keys);
+  free(m.ids);
+  free(free_ids);
+  free(sizes);
+  return t;
+}
+
+// `touch` writes every byte handed out, the timing pass leaves memory alone
+// so it measures the allocator and not page faults
+static void replay(const Allocator *a, const Trace *t, void **slots,
+                   int touch) {
+  for (size_t i = 0; i < t->len; i++) {
+    const Op *op = &t->ops[i];
+    switch (op->op) {
+    case HEAP_TRACE_ALLOC:
+      slots[op->id] = a->malloc(op->size);
+      if (touch && slots[op->id] != NULL)
+        memset(slots[op->id], 0xa5, op->size);
+      break;
+    case HEAP_TRACE_REALLOC:
+      slots[op->id] = a->realloc(slots[op->id], op->size);
+      if (touch && slots[op->id] != NULL)
+        memset(slots[op->id], 0xa5, op->size);
+      break;
+    case HEAP_TRACE_FREE:
+      a->free(slots[op->id]);
+      slots[op->id] = NULL;
+      break;
+    }
+  }
+  for (size_t id = 0; id < t->num_ids; id++) {
+    a->free(slots[id]);
+    slots[id] = NULL;
+  }
+}
+
+static void run(const Allocator *a, const Trace *t) {
+  fflush(stdout);
+  const pid_t pid = fork();
+  if (pid != 0) {
+    waitpid(pid, NULL, 0);
+    return;
+  }
+
+  void **slots = mmap(NULL, (t->num_ids + 1) * sizeof(void *),
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+  memset(slots, 0, (t->num_ids + 1) * sizeof(void *));
+  const size_t base = rss_bytes();
+
+  const double start = now();
+  replay(a, t, slots, 0);
+  const double elapsed = now() - start;
+
+  replay(a, t, slots, 1);
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  const size_t peak = (size_t)ru.ru_maxrss * 1024;
+  const size_t footprint = peak > base ? peak - base : 0;
+
+  printf("%-10s %10zu %8.2f %12zu %12zu %8.1f%%\n", a->name, t->len,
+         elapsed * 1e9 / t->len, t->peak_live, footprint,
+         footprint > t->peak_live
+             ? 100.0 * (1.0 - (double)t->peak_live / footprint)
+             : 0.0);
+  exit(0);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s TRACE\n", argv[0]);
+    return 1;
+  }
+  const Trace t = trace_load(argv[1]);
+  if (t.len == 0) {
+    fprintf(stderr, "replay: %s holds no events\n", argv[1]);
+    return 1;
+  }
+
+  const Allocator allocators[] = {
+      {"easymalloc", heap_alloc, heap_realloc, heap_free},
+      {"glibc", malloc, realloc, free},
+  };
+  printf("%-10s %10s %8s %12s %12s %9s\n", "allocator", "ops", "ns/op",
+         "peak live", "footprint", "frag");
+  for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++)
+    run(&allocators[i], &t);
+  return 0;
+}
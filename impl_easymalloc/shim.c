@@ -0,0 +1,129 @@
+// malloc family on top of easymalloc, build libeasymalloc.so and run any
+// dynamically linked program on it with
+//
+//   LD_PRELOAD=./libeasymalloc.so ./prog
+//
+// with EASYMALLOC_TRACE=path set every call is also recorded for replay to
+// path.<pid>, so an exec'd child gets its own file, a forked one stops
+// tracing, with EASYMALLOC_STATS set heap_stats goes to stderr at exit, with
+// EASYMALLOC_PROFILE=path the blocks still live at exit are sampled to path,
+// one per EASYMALLOC_PROFILE_RATE bytes (512K by default), with
+// EASYMALLOC_TRIM set free pages go back to the OS in the background, with
+// EASYMALLOC_HUGEPAGE set the heap is backed by transparent huge pages
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "easymalloc.h"
+
+size_t malloc_usable_size(void *ptr);
+void *memalign(size_t align, size_t size);
+void *pvalloc(size_t size);
+void *valloc(size_t size);
+
+// the heap leaves errno alone, callers of the malloc family check it
+static void *nomem(void *ptr) {
+  if (ptr == NULL)
+    errno = ENOMEM;
+  return ptr;
+}
+
+// callers may not expect NULL for a zero-sized request
+void *malloc(size_t size) { return nomem(heap_alloc(size > 0 ? size : 1)); }
+
+void free(void *ptr) { heap_free(ptr); }
+
+void *calloc(size_t nmemb, size_t size) {
+  if (size != 0 && nmemb > SIZE_MAX / size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  // malloc plus memset would be folded back into a call to calloc
+  void *ptr = heap_alloc(nmemb * size > 0 ? nmemb * size : 1);
+  if (ptr != NULL)
+    memset(ptr, 0, nmemb * size);
+  return nomem(ptr);
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (ptr == NULL)
+    return malloc(size);
+  return nomem(heap_realloc(ptr, size));
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+  if (size != 0 && nmemb > SIZE_MAX / size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(ptr, nmemb * size);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size) {
+  if (align == 0 || align % sizeof(void *) != 0 || (align & (align - 1)) != 0)
+    return EINVAL;
+  void *ptr = heap_alloc_aligned(size > 0 ? size : 1, align);
+  if (ptr == NULL)
+    return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+  if (align == 0 || (align & (align - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return nomem(heap_alloc_aligned(size > 0 ? size : 1, align));
+}
+
+void *memalign(size_t align, size_t size) { return aligned_alloc(align, size); }
+
+void *valloc(size_t size) {
+  return nomem(heap_alloc_aligned(size > 0 ? size : 1, sysconf(_SC_PAGESIZE)));
+}
+
+void *pvalloc(size_t size) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  return valloc((size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr) { return heap_usable_size(ptr); }
+
+__attribute__((constructor)) static void shim_init(void) {
+  const char *path = getenv("EASYMALLOC_TRACE");
+  if (path != NULL) {
+    char buf[4096];
+    if (snprintf(buf, sizeof(buf), "%s.%d", path, (int)getpid()) <
+        (int)sizeof(buf))
+      heap_trace_start(buf);
+  }
+  if (getenv("EASYMALLOC_PROFILE") != NULL) {
+    const char *rate = getenv("EASYMALLOC_PROFILE_RATE");
+    heap_profile_start(rate != NULL ? strtoul(rate, NULL, 10) : 512 * 1024);
+  }
+  if (getenv("EASYMALLOC_TRIM") != NULL)
+    heap_trim_background();
+  if (getenv("EASYMALLOC_HUGEPAGE") != NULL)
+    heap_hugepage();
+}
+
+__attribute__((destructor)) static void shim_fini(void) {
+  heap_trace_stop();
+  if (getenv("EASYMALLOC_STATS") != NULL)
+    heap_stats_dump(STDERR_FILENO);
+  const char *path = getenv("EASYMALLOC_PROFILE");
+  if (path != NULL) {
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+      heap_profile_dump(fd);
+      close(fd);
+    }
+  }
+}
@@ -0,0 +1,122 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "easymalloc.h"
+#include "slab.h"
+
+static void slab_push(Slab **list, Slab *s) {
+  s->prev = NULL;
+  s->next = *list;
+  if (s->next != NULL)
+    s->next->prev = s;
+  *list = s;
+}
+
+static void slab_unlink(Slab **list, Slab *s) {
+  if (s->prev != NULL) {
+    s->prev->next = s->next;
+  } else {
+    *list = s->next;
+  }
+  if (s->next != NULL)
+    s->next->prev = s->prev;
+}
+
+static Slab *slab_new(SlabCache *c) {
+  Slab *s = heap_alloc_aligned(SLAB_SIZE, SLAB_SIZE);
+  if (s == NULL)
+    return NULL;
+  s->cache = c;
+  s->used = 0;
+  memset(s->free, 0, sizeof(s->free));
+  for (size_t i = 0; i < c->per_slab; i++)
+    s->free[i / 64] |= 1ull << (i % 64);
+  return s;
+}
+
+// objects are rounded up to SLAB_OBJ_MIN so that every slot keeps the
+// alignment heap_alloc gives
+SlabCache *slab_create(size_t obj_size) {
+  obj_size = (obj_size + SLAB_OBJ_MIN - 1) & ~(size_t)(SLAB_OBJ_MIN - 1);
+  if (obj_size == 0)
+    obj_size = SLAB_OBJ_MIN;
+  const size_t offset = (sizeof(Slab) + SLAB_OBJ_MIN - 1) &
+                        ~(size_t)(SLAB_OBJ_MIN - 1);
+  if (obj_size > SLAB_SIZE - offset)
+    return NULL;
+
+  SlabCache *c = heap_alloc(sizeof(SlabCache));
+  if (c == NULL)
+    return NULL;
+  c->obj_size = obj_size;
+  c->offset = offset;
+  c->per_slab = (SLAB_SIZE - offset) / obj_size;
+  c->partial = NULL;
+  c->full = NULL;
+  c->empty = NULL;
+  return c;
+}
+
+void *slab_alloc(SlabCache *c) {
+  Slab *s = c->partial;
+  if (s == NULL) {
+    s = c->empty;
+    if (s != NULL) {
+      c->empty = NULL;
+    } else if ((s = slab_new(c)) == NULL) {
+      return NULL;
+    }
+    slab_push(&c->partial, s);
+  }
+
+  size_t w = 0;
+  while (s->free[w] == 0)
+    w++;
+  const size_t bit = __builtin_ctzll(s->free[w]);
+  s->free[w] &= ~(1ull << bit);
+  s->used += 1;
+  if (s->used == c->per_slab) {
+    slab_unlink(&c->partial, s);
+    slab_push(&c->full, s);
+  }
+  return (char *)s + c->offset + (w * 64 + bit) * c->obj_size;
+}
+
+// one empty slab stays around so that a cache hovering at a slab boundary
+// does not keep going back to the heap
+void slab_free(SlabCache *c, void *ptr) {
+  if (ptr == NULL)
+    return;
+
+  Slab *s = (Slab *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+  assert(s->cache == c);
+  const size_t i = ((char *)ptr - (char *)s - c->offset) / c->obj_size;
+  assert(!(s->free[i / 64] & (1ull << (i % 64))));
+  s->free[i / 64] |= 1ull << (i % 64);
+
+  if (s->used == c->per_slab) {
+    slab_unlink(&c->full, s);
+    slab_push(&c->partial, s);
+  }
+  s->used -= 1;
+  if (s->used == 0) {
+    slab_unlink(&c->partial, s);
+    if (c->empty != NULL)
+      heap_free(c->empty);
+    c->empty = s;
+  }
+}
+
+void slab_destroy(SlabCache *c) {
+  Slab *lists[] = {c->partial, c->full, c->empty};
+  for (size_t i = 0; i < 3; i++) {
+    Slab *s = lists[i];
+    while (s != NULL) {
+      Slab *next = s->next;
+      heap_free(s);
+      s = next;
+    }
+  }
+  heap_free(c);
+}
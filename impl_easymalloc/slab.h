@@ -0,0 +1,38 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// fixed-size object cache, objects are carved out of SLAB_SIZE aligned
+// slabs taken from the heap and tracked with one bit per slot, a cache is
+// not thread safe
+#define SLAB_SIZE 4096
+#define SLAB_OBJ_MIN 16
+#define SLAB_SLOT_LIMIT (SLAB_SIZE / SLAB_OBJ_MIN)
+
+typedef struct SlabCache SlabCache;
+
+typedef struct Slab {
+  struct Slab *next;
+  struct Slab *prev;
+  SlabCache *cache;
+  size_t used;
+  uint64_t free[SLAB_SLOT_LIMIT / 64];
+} Slab;
+
+struct SlabCache {
+  size_t obj_size;
+  size_t per_slab;
+  size_t offset;
+  Slab *partial;
+  Slab *full;
+  Slab *empty;
+};
+
+SlabCache *slab_create(size_t obj_size);
+void *slab_alloc(SlabCache *c);
+void slab_free(SlabCache *c, void *ptr);
+void slab_destroy(SlabCache *c);
+
+#endif // SLAB_H_
@@ -1,3 +1,10 @@
+#include <stdlib.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#endif
+
 #define START_SIZE 4
 
 #define ROUND_UP(x)                                                            \
@@ -12,6 +19,24 @@
     _x + 1;                                                                    \
   })
 
+// the slots the allocator really handed out for a request of `cap`, only
+// glibc and macOS can be asked, anywhere else it is just `cap`
+static inline size_t array_usable(void *buffer, size_t cap, size_t size) {
+#if defined(__GLIBC__)
+  (void)cap;
+  return malloc_usable_size(buffer) / size;
+#elif defined(__APPLE__)
+  (void)cap;
+  return malloc_size(buffer) / size;
+#else
+  (void)buffer;
+  (void)size;
+  return cap;
+#endif
+}
+
+// the allocator rounds every request up, the capacity is whatever the
+// buffer can really hold so the rounding saves reallocations
 #define InitArray(type)                                                        \
   typedef struct {                                                             \
     size_t cap;                                                                \
@@ -27,7 +52,7 @@
         fprintf(stderr, "Error: array_" #type " write\n");                     \
         exit(EXIT_FAILURE);                                                    \
       }                                                                        \
-      arr->cap = cap;                                                          \
+      arr->cap = array_usable(arr->buffer, cap, sizeof(type));                 \
       arr->buffer[arr->len++] = slot;                                          \
       return;                                                                  \
     }                                                                          \
@@ -38,15 +63,13 @@
     }                                                                          \
                                                                                \
     size_t cap = ROUND_UP(arr->cap + 1);                                       \
-    type *buffer = malloc(cap * sizeof(type));                                 \
+    type *buffer = realloc(arr->buffer, cap * sizeof(type));                   \
     if (buffer == NULL) {                                                      \
       fprintf(stderr, "Error: array_" #type " write\n");                       \
       exit(EXIT_FAILURE);                                                      \
     }                                                                          \
-    memcpy(buffer, arr->buffer, arr->len * sizeof(type));                      \
-    free(arr->buffer);                                                         \
     arr->buffer = buffer;                                                      \
-    arr->cap = cap;                                                            \
+    arr->cap = array_usable(buffer, cap, sizeof(type));                        \
     arr->buffer[arr->len++] = slot;                                            \
   }                                                                            \
                                                                                \